@@ -1,12 +1,15 @@
 #include "model.hpp"
 
-// A simple example of two machines, one continuously sending a value to the
-// other until it responds
+// A simple example of two machines, one repeatedly sending a value to the
+// other until it responds (or it has sent it SEND_TRIES times)
 
-#define MSG_TMR 1
 #define MSG_ACK 2
 #define MSG_VAL 3
 
+#define TMR_SEND 0
+
+#define SEND_TRIES 3
+
 #define MCH_SND 1
 #define MCH_RCV 2
 
@@ -19,6 +22,11 @@ struct Val : Message {
         return val - dynamic_cast<Val*>(rhs)->val;
     }
 
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, val);
+        return true;
+    }
+
     void sub_print() const override {
         printf("    Value %d\n", val);
     }
@@ -28,27 +36,26 @@ struct Sender : Machine {
     id_t dst;
     int val;
     bool ack;
+    // Times the value has been sent
+    int sends;
 
     Sender(id_t id, id_t dst, int val)
-        : Machine(id, MCH_SND), dst(dst), val(val), ack(false) {}
+        : Machine(id, MCH_SND, true), dst(dst), val(val), ack(false),
+          sends(0) {}
 
     Sender* clone() const override {
         Sender* s = new Sender(id, dst, val);
         s->ack = ack;
+        s->sends = sends;
         return s;
     }
 
     std::vector<Message*> handle_message(Message* m) override {
         std::vector<Message*> ret;
         switch (m->type) {
-            case MSG_TMR:
-                if (!ack) {
-                    ret.push_back(new Val(id, dst, val));
-                    ret.push_back(new Message(id, id, MSG_TMR));
-                }
-                break;
             case MSG_ACK:
                 ack = true;
+                cancel(TMR_SEND);
                 break;
             default:
                 error = ERR_BADMSG;
@@ -57,20 +64,49 @@ struct Sender : Machine {
         return ret;
     }
 
+    // Resend the value until it is acknowledged, or has been sent often
+    // enough; an unbounded number of copies would make the state space
+    // infinite
+    std::vector<Message*> on_timer(int t) override {
+        std::vector<Message*> ret;
+        if (!ack && sends < SEND_TRIES) {
+            ++sends;
+            ret.push_back(new Val(id, dst, val));
+            arm(TMR_SEND);
+        }
+        return ret;
+    }
+
     std::vector<Message*> on_startup() override {
         #ifdef B
         ack = true;
         #endif
-        std::vector<Message*> ret;
-        ret.push_back(new Message(id, id, MSG_TMR));
-        return ret;
+        arm(TMR_SEND);
+        return std::vector<Message*>{};
+    }
+
+    // The value is durable, but whether it was acknowledged (and how often
+    // it was sent) is forgotten, so the sender starts resending it
+    std::vector<Message*> on_restart() override {
+        ack = false;
+        sends = 0;
+        arm(TMR_SEND);
+        return std::vector<Message*>{};
     }
 
     int sub_compare(Machine* rhs) const override {
         Sender* m = dynamic_cast<Sender*>(rhs);
         if (int r = val - m->val) return r;
+        if (int r = sends - m->sends) return r;
         return ack - m->ack;
     }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, val);
+        flat_put(out, ack);
+        flat_put(out, sends);
+        return true;
+    }
 };
 
 struct Receiver : Machine {
@@ -104,6 +140,12 @@ struct Receiver : Machine {
         if (int r = val - m->val) return r;
         return recv - m->recv;
     }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, val);
+        flat_put(out, recv);
+        return true;
+    }
 };
 
 bool invariant(const SystemState& st) {
@@ -114,7 +156,80 @@ bool invariant(const SystemState& st) {
     return true;
 }
 
-int main() {
+void print_usage(const char* progname) {
+    fprintf(stderr, "usage: %s [OPTIONS]\n"
+                    "   -h: print this help message and exit\n"
+                    "   -d: maximum depth, or -1 for none; defaults to -1\n"
+                    "   -D: maximum number of messages dropped, or -1 for\n"
+                    "       none; defaults to -1\n"
+                    "   -U: maximum number of messages duplicated, or -1 for\n"
+                    "       none; defaults to 0\n"
+                    "   -C: maximum number of sender crashes, or -1 for none;\n"
+                    "       defaults to 0\n",
+                    progname);
+}
+
+// Parse a bound (non-negative, or -1 for none) into `out`
+static bool parse_bound(const char* arg, int& out) {
+    char* end = nullptr;
+    out = strtol(arg, &end, 10);
+    return !*end && out >= -1;
+}
+
+int main(int argc, char** argv) {
+    int depth = -1;
+    int drops = -1;
+    int dups = 0;
+    int crashes = 0;
+    int c;
+    while ((c = getopt(argc, argv, "hd:D:U:C:")) != -1) {
+        switch(c) {
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            case 'd':
+                if (!parse_bound(optarg, depth)) {
+                    fprintf(stderr, "%s: invalid maximum depth %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (!parse_bound(optarg, drops)) {
+                    fprintf(stderr, "%s: invalid maximum drops %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'U':
+                if (!parse_bound(optarg, dups)) {
+                    fprintf(stderr, "%s: invalid maximum duplicates %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'C':
+                if (!parse_bound(optarg, crashes)) {
+                    fprintf(stderr, "%s: invalid maximum crashes %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "%s: too many arguments\n", argv[0]);
+        print_usage(argv[0]);
+        return 1;
+    }
+
     srand(time(0));
     std::vector<Machine*> m;
     m.push_back(new Sender(0, 1, rand()));
@@ -122,8 +237,12 @@ int main() {
     std::vector<Predicate> i;
     i.push_back(Predicate{"Consistency", invariant});
     Model model{m, i};
+    model.max_drops = drops;
+    model.max_dups = dups;
+    model.max_crashes = crashes;
 
-    std::set<SystemState> res = model.run();
-    printf("Simluation exited with %lu terminating states.\n", res.size());
+    Result res = model.run(depth);
+    if (!res.ok()) return 1;
+    printf("Simluation exited with %lu terminating states.\n", res.terminated);
     return 0;
 }
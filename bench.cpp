@@ -0,0 +1,231 @@
+#include <numeric>
+#include "model.hpp"
+
+// Microbenchmarks for the byte kernels (see bytes_hash): the vector hash
+// against the scalar one, and equality and comparison, over buffers of a few
+// sizes; then comparing whole states through their flat encodings against
+// SystemState::compare, which walks them a virtual call per machine and
+// message. Last, threads insert overlapping sets of flat states into one
+// StateTable at once, checking that each state is added exactly once.
+
+#define MCH_LOG 1
+#define MSG_DATA 2
+
+// A machine with a log of values, and a message carrying one, standing in
+// for a model's state
+struct Data : Message {
+    long value;
+    Data(id_t src, id_t dst, long value)
+        : Message(src, dst, MSG_DATA), value(value) {}
+
+    int sub_compare(Message* rhs) const override {
+        long r = value - dynamic_cast<Data*>(rhs)->value;
+        return r < 0 ? -1 : r > 0;
+    }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, value);
+        return true;
+    }
+};
+
+struct Log : Machine {
+    std::vector<long> log;
+
+    Log(id_t id) : Machine(id, MCH_LOG) {}
+
+    Log* clone() const override {
+        Log* l = new Log(id);
+        l->log = log;
+        return l;
+    }
+
+    int sub_compare(Machine* rhs) const override {
+        Log* m = dynamic_cast<Log*>(rhs);
+        if (long r = log.size() - m->log.size()) return r < 0 ? -1 : 1;
+        for (size_t i = 0; i < log.size(); ++i) {
+            if (log[i] != m->log[i]) return log[i] < m->log[i] ? -1 : 1;
+        }
+        return 0;
+    }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, log.size());
+        for (long v : log) flat_put(out, v);
+        return true;
+    }
+};
+
+// Nanoseconds per call of `f`, over `reps` calls
+template <typename F>
+static double time_ns(size_t reps, F f) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    for (size_t i = 0; i < reps; ++i) f();
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9
+            + (end.tv_nsec - start.tv_nsec)) / reps;
+}
+
+// Keeps results alive so the calls being timed aren't optimized out
+static volatile uint64_t sink;
+
+// A state of `machines` machines with `entries` log entries each, and as many
+// messages in flight, all built afresh (so two such states share nothing)
+static SystemState make_state(size_t machines, size_t entries) {
+    std::vector<Machine*> m;
+    for (size_t i = 0; i < machines; ++i) {
+        Log* l = new Log(i);
+        for (size_t j = 0; j < entries; ++j) l->log.push_back(i * entries + j);
+        m.push_back(l);
+    }
+    SystemState s{m};
+    for (size_t i = 0; i < machines; ++i) {
+        Message* msg = new Data(i, (i + 1) % machines, i);
+        s.send(msg);
+        msg->ref_dec();
+    }
+    return s;
+}
+
+static void bench_kernels(size_t reps) {
+    printf("%8s %14s %14s %14s %14s\n", "bytes", "hash", "(scalar)",
+           "equal", "compare");
+    std::mt19937_64 r;
+    for (size_t n : {64, 256, 1024, 4096, 16384}) {
+        std::string a(n, 0);
+        for (char& c : a) c = r();
+        std::string b = a;
+        size_t k = reps * 1024 / n;
+        double hash[2];
+        for (int scalar = 0; scalar < 2; ++scalar) {
+            bytes_kernels(!scalar);
+            hash[scalar] = time_ns(k, [&] {
+                sink = sink + bytes_hash(a.data(), n);
+            });
+        }
+        bytes_kernels(true);
+        double eq = time_ns(k, [&] {
+            sink = sink + bytes_equal(a.data(), b.data(), n);
+        });
+        double cmp = time_ns(k, [&] {
+            sink = sink + bytes_compare(a.data(), b.data(), n);
+        });
+        printf("%8lu %12.1fns %12.1fns %12.1fns %12.1fns\n", n, hash[0],
+               hash[1], eq, cmp);
+    }
+}
+
+static void bench_states(size_t reps) {
+    printf("\n%8s %8s %14s %14s %14s\n", "machines", "entries",
+           "compare", "flat equal", "flat hash");
+    for (size_t machines : {4, 16, 64}) {
+        for (size_t entries : {4, 64}) {
+            SystemState a = make_state(machines, entries);
+            SystemState b = make_state(machines, entries);
+            FlatState fa{a}, fb{b};
+            size_t k = reps * 16 / machines;
+            double cmp = time_ns(k, [&] { sink = sink + a.compare(&b); });
+            double eq = time_ns(k, [&] { sink = sink + (fa == fb); });
+            double hash = time_ns(k, [&] {
+                sink = sink + bytes_hash(fa.buf.data(), fa.buf.size());
+            });
+            printf("%8lu %8lu %12.1fns %12.1fns %12.1fns\n", machines,
+                   entries, cmp, eq, hash);
+        }
+    }
+}
+
+// Insert `count` distinct flat states into a StateTable from each of
+// `threads` threads at once, each in its own order; every state should be
+// added by exactly one of them, and found with the record it was added as.
+// Returns whether it was.
+static bool bench_table(size_t count, unsigned threads) {
+    SystemState base = make_state(4, 4);
+    std::vector<FlatState> states(count, FlatState{base});
+    for (size_t i = 0; i < count; ++i) {
+        // Overwrite the last word (a fault count and padding) to tell them
+        // apart
+        memcpy(&states[i].buf[states[i].buf.size() - 8], &i, 8);
+    }
+
+    StateTable table;
+    std::vector<std::atomic<StateTable::Record*>> added(count);
+    std::atomic<size_t> twice{0};
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; ++t) {
+        pool.emplace_back([&, t] {
+            // A different stride through the states for each thread
+            size_t stride = 2 * t + 1;
+            while (std::gcd(stride, count) != 1) stride += 2;
+            for (size_t k = 0, i = t; k < count; ++k, i = (i + stride) % count) {
+                auto [r, fresh] = table.insert(states[i], 0);
+                if (!fresh) continue;
+                StateTable::Record* none = nullptr;
+                if (!added[i].compare_exchange_strong(none, r)) ++twice;
+            }
+        });
+    }
+    for (std::thread& t : pool) t.join();
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+    size_t missing = 0;
+    for (size_t i = 0; i < count; ++i) {
+        StateTable::Record* r = table.find(states[i]);
+        if (!r || r != added[i].load()) ++missing;
+    }
+    double ns = (end.tv_sec - start.tv_sec) * 1e9
+        + (end.tv_nsec - start.tv_nsec);
+    printf("\n%lu states inserted by each of %u threads: %.1fns per insert\n"
+           "    Stored: %lu, added twice: %lu, not found: %lu\n", count,
+           threads, ns / (count * threads), table.size(), twice.load(),
+           missing);
+    return table.size() == count && !twice && !missing;
+}
+
+void print_usage(const char* progname) {
+    fprintf(stderr, "usage: %s [OPTIONS]\n"
+                    "   -h: print this help message and exit\n"
+                    "   -r: repetitions (in thousands) of each benchmark;\n"
+                    "       defaults to 100\n",
+                    progname);
+}
+
+int main(int argc, char** argv) {
+    size_t reps = 100;
+    int c;
+    char* end;
+    while ((c = getopt(argc, argv, "hr:")) != -1) {
+        switch (c) {
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            case 'r':
+                end = nullptr;
+                reps = strtoul(optarg, &end, 10);
+                if (*end || !reps) {
+                    fprintf(stderr, "%s: invalid number of repetitions %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "%s: too many arguments\n", argv[0]);
+        print_usage(argv[0]);
+        return 1;
+    }
+    reps *= 1000;
+
+    bench_kernels(reps);
+    bench_states(reps);
+    unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+    return bench_table(reps * 4, threads) ? 0 : 1;
+}
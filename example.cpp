@@ -27,6 +27,10 @@ struct Sender : Machine {
     int sub_compare(Machine* rhs) const override {
         return 0;
     }
+
+    bool sub_flatten(std::string& out) const override {
+        return true;
+    }
 };
 
 struct Receiver : Machine {
@@ -52,15 +56,25 @@ struct Receiver : Machine {
     int sub_compare(Machine* rhs) const override {
         Receiver* m = dynamic_cast<Receiver*>(rhs);
         if (long r = log.size() - m->log.size()) return r;
-        return memcmp(log.data(), m->log.data(), log.size() * sizeof(int));
+        return bytes_compare((const char*) log.data(),
+                             (const char*) m->log.data(),
+                             log.size() * sizeof(id_t));
+    }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, log.size());
+        for (id_t i : log) flat_put(out, i);
+        return true;
     }
 };
 
 void print_usage(const char* progname) {
-    fprintf(stderr, "usage: %s [-h] [-n senders] [-o]\n"
+    fprintf(stderr, "usage: %s [-h] [-n senders] [-o] [-p]\n"
                     "   -h: print this help message and exit\n"
                     "   -n: number of senders; defaults to 9\n"
-                    "   -o: should ordering matter; defaults to no\n",
+                    "   -o: should ordering matter; defaults to no\n"
+                    "   -p: search statelessly with partial-order reduction;\n"
+                    "       defaults to no\n",
                     progname);
 }
 
@@ -68,9 +82,10 @@ int main(int argc, char** argv) {
     // parse args
     size_t n = 9;
     bool ordered = false;
+    bool dpor = false;
     int c;
     char* end;
-    while ((c = getopt(argc, argv, "hn:o")) != -1) {
+    while ((c = getopt(argc, argv, "hn:op")) != -1) {
         switch(c) {
             case 'h':
                 print_usage(argv[0]);
@@ -88,6 +103,9 @@ int main(int argc, char** argv) {
             case 'o':
                 ordered = true;
                 break;
+            case 'p':
+                dpor = true;
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
@@ -106,33 +124,29 @@ int main(int argc, char** argv) {
     }
     std::vector<Predicate> i;
     if (ordered) {
-        auto pred = [n] (const SystemState& s) {
-            // All the sent messages plus everything in the log should
-            // cooperatively contain all numbers only once
-            // For some reason we have to cast void* to unsigned*
-            unsigned* counts = (unsigned*) malloc((n + 1) * sizeof *counts);
-            memset(counts, 0, (n + 1) * sizeof *counts);
-            for (size_t i = 0; i < s.messages.size(); ++i) {
-                counts[s.messages[i]->src]++;
-            }
-            Receiver* r = dynamic_cast<Receiver*>(s.machines[0]);
-            for (size_t i = 0; i < r->log.size(); ++i) {
-                counts[r->log[i]]++;
-            }
-            for (size_t i = 1; i <= n; ++i) {
-                if (counts[i] != 1) {
-                    free(counts);
-                    return false;
-                }
+        // All the sent messages plus everything in the log should
+        // cooperatively contain all numbers only once. Messages here are
+        // never dropped or duplicated, and each sender sends just one, so
+        // only the receiver's log can break that: it must hold each sender
+        // at most once. The counts are reused rather than allocated for
+        // every check (per thread, as simulations may check concurrently).
+        auto pred = [n] (Machine* m) {
+            Receiver* r = dynamic_cast<Receiver*>(m);
+            if (!r) return true;
+            thread_local std::vector<unsigned> counts;
+            counts.assign(n + 1, 0);
+            for (id_t i : r->log) {
+                if (i < 1 || i > n || counts[i]++) return false;
             }
-            free(counts);
             return true;
         };
         i.push_back(Predicate{"Basic", pred});
     }
     Model model{m, i};
 
-    std::set<SystemState> res = model.run(-1, !ordered);
-    printf("Simluation exited with %lu terminating states.\n", res.size());
+    Result res = dpor ? model.run_dpor() : model.run(-1, !ordered);
+    if (!res.ok()) return 1;
+    printf("Simluation exited with %lu terminating states.\n",
+           res.terminated);
     return 0;
 }
@@ -1,9 +1,18 @@
 #include "model.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <typeinfo>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 struct LogicalMachine {
     Machine* m;
-    std::vector<Message*> outgoing;
-    std::vector<Message*> incoming;
+    MessageList outgoing;
+    MessageList incoming;
 
     LogicalMachine (Machine* m) : m(m) {
         m->ref_inc();
@@ -11,32 +20,29 @@ struct LogicalMachine {
 
     // We have to override the default copy constructor to ensure the refcounts
     // are correct
-    LogicalMachine (const LogicalMachine& rhs) {
-        m = rhs.m;
+    LogicalMachine (const LogicalMachine& rhs)
+        : m(rhs.m), outgoing(rhs.outgoing), incoming(rhs.incoming) {
         m->ref_inc();
-        outgoing = rhs.outgoing;
-        for (Message*& m : outgoing) m->ref_inc();
-        incoming = rhs.incoming;
-        for (Message*& m : incoming) m->ref_inc();
     }
 
     ~LogicalMachine() {
         m->ref_dec();
-        for (Message*& m : outgoing) m->ref_dec();
-        for (Message*& m : incoming) m->ref_dec();
+    }
+
+    static int compare(const MessageList& a, const MessageList& b) {
+        if (a.shares(b)) return 0;
+        for (auto i = a.begin(), j = b.begin(); i != a.end(); ++i, ++j) {
+            if (int r = (*i)->logical_compare(*j)) return r;
+        }
+        return 0;
     }
 
     int compare(const LogicalMachine* rhs) const {
         if (int r = m->logical_compare(rhs->m)) return r;
         if (long r = (long) outgoing.size() - rhs->outgoing.size()) return r;
         if (long r = (long) incoming.size() - rhs->incoming.size()) return r;
-        for (size_t i = 0; i < outgoing.size(); ++i) {
-            if (int r = outgoing[i]->logical_compare(rhs->outgoing[i])) return r;
-        }
-        for (size_t i = 0; i < incoming.size(); ++i) {
-            if (int r = incoming[i]->logical_compare(rhs->incoming[i])) return r;
-        }
-        return 0;
+        if (int r = compare(outgoing, rhs->outgoing)) return r;
+        return compare(incoming, rhs->incoming);
     }
 
     bool operator<(const LogicalMachine& rhs) const {
@@ -46,202 +52,3251 @@ struct LogicalMachine {
 
 struct LogicalState {
     std::vector<LogicalMachine> machines;
+    // Fault counts (see SystemState)
+    int drops;
+    int dups;
+    int crashes;
 
     LogicalState() {}
 
-    // Construct from a (normal) state
-    LogicalState(SystemState& s) {
+    // Construct from a (normal) state; if `all_fifo`, every message is treated
+    // as fifo
+    LogicalState(SystemState& s, bool all_fifo = false)
+        : drops(s.drops), dups(s.dups), crashes(s.crashes) {
         for (Machine*& m : s.machines) {
             // avoid an extra copy construction via emplacement
             machines.emplace_back(m);
         }
 
-        for (Message*& m : s.messages) {
-            machines[m->src].outgoing.push_back(m);
-            m->ref_inc();
-            machines[m->dst].incoming.push_back(m);
-            m->ref_inc();
-        }
-
-        for (LogicalMachine& m : machines) {
-            auto lambda = [] (Message* a, Message* b) {
-                return a->logical_compare(b) < 0;
+        // The order of fifo messages within a channel matters, so those go
+        // after all the others (which are sorted), grouped by channel but
+        // otherwise in the order they were sent. That's the order the state
+        // keeps its buckets in (if it does), unless every message is fifo.
+        if (!all_fifo && !s.incoming.empty()) {
+            for (size_t j = 0; j < machines.size(); ++j) {
+                machines[j].outgoing = s.outgoing[j];
+                machines[j].incoming = s.incoming[j];
+            }
+        } else {
+            std::vector<std::vector<Message*>> outgoing(machines.size());
+            std::vector<std::vector<Message*>> incoming(machines.size());
+            for (Message* m : s.messages) {
+                outgoing[m->src].push_back(m);
+                incoming[m->dst].push_back(m);
+            }
+            auto order = [all_fifo] (bool outgoing) {
+                return [all_fifo, outgoing] (Message* a, Message* b) {
+                    bool fa = all_fifo || a->fifo, fb = all_fifo || b->fifo;
+                    if (fa != fb) return fa < fb;
+                    if (fa) {
+                        return outgoing ? a->dst < b->dst : a->src < b->src;
+                    }
+                    return a->logical_compare(b) < 0;
+                };
             };
-            std::sort(m.outgoing.begin(), m.outgoing.end(), lambda);
-            std::sort(m.incoming.begin(), m.incoming.end(), lambda);
+            for (size_t j = 0; j < machines.size(); ++j) {
+                std::stable_sort(outgoing[j].begin(), outgoing[j].end(),
+                                 order(true));
+                std::stable_sort(incoming[j].begin(), incoming[j].end(),
+                                 order(false));
+                for (Message* m : outgoing[j]) machines[j].outgoing.push_back(m);
+                for (Message* m : incoming[j]) machines[j].incoming.push_back(m);
+            }
         }
 
         std::sort(machines.begin(), machines.end());
     }
 
     bool operator<(const LogicalState& rhs) const {
+        if (drops != rhs.drops) return drops < rhs.drops;
+        if (dups != rhs.dups) return dups < rhs.dups;
+        if (crashes != rhs.crashes) return crashes < rhs.crashes;
         return machines < rhs.machines;
     }
 };
 
 #define in_set(set, val) ((set).find(val) != (set).end())
 
-std::vector<SystemState> get_all_neighbors(std::vector<SystemState>& nodes,
-                                           bool exclude_symmetries,
-                                           std::set<SystemState>& terminating,
-                                           std::set<SystemState>& visited) {
-    std::set<LogicalState> logical_states;
-    std::vector<SystemState> ret;
+// Deliver `del->delivered` to its destination in `next`, which has already had
+// the message removed. The destination machine is replaced if it changed, and
+// any messages it sends are recorded in `del` and added to `next`. When
+// `profiled` is false, none of the instrumentation is compiled in.
+template <bool profiled>
+static void deliver(SystemState& next, Diff* del, Profile& profile) {
+    unsigned long t0, t1, t2;
+    if constexpr (profiled) t0 = Profile::now();
 
-    for (const SystemState& n : nodes) {
-        for (size_t i = 0; i < n.messages.size(); ++i) {
-            // Each message may be delivered or dropped to make a new state
-            Diff* del = new Diff();
-            Diff* drop = new Diff();
-            del->delivered = n.messages[i];
-            drop->dropped = n.messages[i];
-            // no need to increment these refcounts, because while they now own
-            // them, their next states won't
-
-            SystemState next_del = SystemState(n);
-            next_del.depth = n.depth + 1;
-            next_del.messages.erase(next_del.messages.begin() + i);
-            SystemState next_drop = SystemState(n);
-            next_drop.depth = n.depth + 1;
-            next_drop.messages.erase(next_drop.messages.begin() + i);
-
-            // Since accepting a message may mutate state, clone the machine
-            // first; if it didn't change, we'll delete it later
-            Machine* target = next_del.machines[del->delivered->dst]->clone();
-
-            // This fresh machine object will handle the message, possibly
-            // emitting new messages. These belong in the new message queue.
-            del->sent = target->handle_message(del->delivered);
-
-            if (target->compare(next_del.machines[del->delivered->dst])) {
-                next_del.machines[del->delivered->dst]->ref_dec();
-                next_del.machines[del->delivered->dst] = target;
-            } else {
-                // This should delete it, as it only belonged to this scope
-                target->ref_dec();
-            }
+    // Since accepting a message may mutate state, clone the machine
+    // first; if it didn't change, we'll delete it later
+    Machine* target = next.machines[del->delivered->dst]->copy();
+    if constexpr (profiled) t1 = Profile::now();
 
-            // Add the new messages to the queue
-            for (Message*& m : del->sent) {
-                next_del.messages.push_back(m);
-                m->ref_inc();
-            }
+    // This fresh machine object will handle the message, possibly
+    // emitting new messages. These belong in the new message queue.
+    del->sent = target->handle_message(del->delivered);
+    if constexpr (profiled) t2 = Profile::now();
 
-            // And if this is a new state, add it to the list
-            if (exclude_symmetries) {
-                LogicalState ldel{next_del};
-                LogicalState ldrop{next_drop};
-                if (!in_set(visited, next_del)
-                    && !in_set(logical_states, ldel)) {
-                    next_del.history.push_back(del);
-                    ret.push_back(next_del);
-                    logical_states.insert(ldel);
-                } else {
-                    del->ref_dec();
-                }
-                if (!in_set(visited, next_drop) && drop->dropped->may_drop
-                    && !in_set(logical_states, ldrop)) {
-                    next_drop.history.push_back(drop);
-                    ret.push_back(next_drop);
-                    logical_states.insert(ldrop);
-                } else {
-                    drop->ref_dec();
-                }
-            } else {
-                if (!in_set(visited, next_del)) {
-                    next_del.history.push_back(del);
-                    ret.push_back(next_del);
-                } else {
-                    del->ref_dec();
-                }
-                if (!in_set(visited, next_drop) && drop->dropped->may_drop) {
-                    next_drop.history.push_back(drop);
-                    ret.push_back(next_drop);
-                } else {
-                    drop->ref_dec();
-                }
-            }
+    bool changed = target->compare(next.machines[del->delivered->dst]);
+    if constexpr (profiled) {
+        HandlerStats& h = profile.handlers[{target->type,
+                                            del->delivered->type}];
+        ++h.calls;
+        h.clone_ns += t1 - t0;
+        h.handle_ns += t2 - t1;
+        h.sent += del->sent.size();
+        if (!changed) ++h.unchanged;
+    }
+
+    if (changed) {
+        next.machines[del->delivered->dst]->ref_dec();
+        next.machines[del->delivered->dst] = target;
+    } else {
+        // This should delete it, as it only belonged to this scope
+        target->ref_dec();
+    }
+
+    // Add the new messages to the queue
+    for (Message*& m : del->sent) next.send(m);
+}
+
+// The transitions out of a state are numbered: 3i + a takes message i with
+// action a (one of the first three below), where n messages are pending; then
+// each machine j has a block of 1 + MAX_TIMERS transitions starting at
+// 3n + j * (1 + MAX_TIMERS), the first restarting it and the rest firing each
+// of its timers
+enum Action { DELIVER, DROP, DUPLICATE, RESTART, FIRE };
+
+// (These, and `enabled`, take any state with a SystemState's machines,
+// messages and fault counts, as the random walker keeps its own.)
+template <typename S>
+static size_t transitions(const S& s) {
+    return 3 * s.messages.size() + s.machines.size() * (1 + MAX_TIMERS);
+}
+
+template <typename S>
+static Action action(const S& s, size_t k) {
+    size_t n = 3 * s.messages.size();
+    if (k < n) return (Action) (k % 3);
+    return (k - n) % (1 + MAX_TIMERS) ? FIRE : RESTART;
+}
+
+// The machine a restart or firing acts on
+template <typename S>
+static id_t machine_of(const S& s, size_t k) {
+    return (k - 3 * s.messages.size()) / (1 + MAX_TIMERS);
+}
+
+// The timer a firing fires
+template <typename S>
+static int timer_of(const S& s, size_t k) {
+    return (k - 3 * s.messages.size()) % (1 + MAX_TIMERS) - 1;
+}
+
+// Whether `used` faults leave any of `budget` (-1 for unbounded)
+static bool within(int budget, int used) {
+    return budget < 0 || used < budget;
+}
+
+// Whether transition `k` may be taken from `s` under `model`'s network
+// semantics and fault budgets
+template <typename S>
+static bool enabled(const Model& model, const S& s, size_t k) {
+    Action a = action(s, k);
+    if (a == RESTART) {
+        return s.machines[machine_of(s, k)]->may_crash
+            && within(model.max_crashes, s.crashes);
+    }
+    if (a == FIRE) return s.machines[machine_of(s, k)]->armed(timer_of(s, k));
+    Message* msg = s.messages[k / 3];
+    if (!SystemState::deliverable(s.messages, k / 3, model.fifo)) return false;
+    if (a == DROP) return msg->may_drop && within(model.max_drops, s.drops);
+    if (a == DUPLICATE) return msg->may_drop && within(model.max_dups, s.dups);
+    return true;
+}
+
+// Restart machine `j` of `next`, or fire its timer `t` (if non-negative),
+// recording it in `d`. The machine is only replaced if it changed.
+static void act(SystemState& next, Diff* d, id_t j, int t) {
+    Machine* target = next.machines[j]->copy();
+    if (t < 0) {
+        // Timers don't survive a crash
+        target->timers = 0;
+        d->restarted = j;
+        d->sent = target->on_restart();
+    } else {
+        target->cancel(t);
+        d->fired = j;
+        d->timer = t;
+        d->sent = target->on_timer(t);
+    }
+    if (target->compare(next.machines[j])) {
+        next.machines[j]->ref_dec();
+        next.machines[j] = target;
+    } else {
+        target->ref_dec();
+    }
+    for (Message*& m : d->sent) next.send(m);
+}
+
+// Make the state following `s` by taking transition `k`, with the diff `d`
+// that does so (which gets a reference to the message it acts on). A
+// duplicate is queued as the newest message, and each message transition
+// skips over (and so delays) the older messages before it.
+template <bool profiled>
+static SystemState successor(Model& model, const SystemState& s, size_t k,
+                             Diff* d) {
+    SystemState next{s};
+    next.depth = s.depth + 1;
+    Action a = action(s, k);
+    if (a == RESTART || a == FIRE) {
+        act(next, d, machine_of(s, k), a == FIRE ? timer_of(s, k) : -1);
+        if (a == RESTART && model.max_crashes >= 0) ++next.crashes;
+        return next;
+    }
+
+    size_t i = k / 3;
+    Message* msg = next.messages[i];
+    next.delay = s.delay + i;
+    msg->ref_inc();
+    if (a == DUPLICATE) {
+        d->duplicated = msg;
+        next.send(msg);
+        if (model.max_dups >= 0) ++next.dups;
+        return next;
+    }
+    next.take(i);
+    if (a == DROP) {
+        d->dropped = msg;
+        if (model.max_drops >= 0) ++next.drops;
+    } else {
+        d->delivered = msg;
+        deliver<profiled>(next, d, model.profile);
+    }
+    return next;
+}
+
+// Whether `next`, reached from `s` by `d`, is just `s` again: a timer fired
+// without changing its machine or sending anything. This is cheap to check,
+// since unchanged machines aren't replaced, and such steps are never taken.
+static bool stutters(const SystemState& s, const SystemState& next,
+                     const Diff* d) {
+    return d->fired >= 0 && d->sent.empty()
+        && next.machines[d->fired] == s.machines[d->fired];
+}
+
+// The transition from `s` which `d` records (matching messages by value, so
+// the history may come from another copy of the search), or
+// transitions(s) if there is none
+static size_t step_of(const Model& model, const SystemState& s,
+                      const Diff* d) {
+    size_t n = 3 * s.messages.size();
+    if (d->restarted >= 0 || d->fired >= 0) {
+        size_t k = d->restarted >= 0 ? n + d->restarted * (1 + MAX_TIMERS)
+            : n + d->fired * (1 + MAX_TIMERS) + 1 + d->timer;
+        return k < transitions(s) && enabled(model, s, k) ? k
+            : transitions(s);
+    }
+    Message* m = d->delivered ? d->delivered
+        : d->dropped ? d->dropped : d->duplicated;
+    Action a = d->delivered ? DELIVER : d->dropped ? DROP : DUPLICATE;
+    size_t i = 0;
+    for (Message* o : s.messages) {
+        if (!o->compare(m) && enabled(model, s, 3 * i + a)) return 3 * i + a;
+        ++i;
+    }
+    return transitions(s);
+}
+
+// Finish a hash by mixing its bits (the MurmurHash3 finalizer)
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    return h ^ h >> 33;
+}
+
+// bytes_hash runs four 64-bit accumulators over 32-byte stripes, as XXH3
+// does: each word is keyed, its halves multiplied together and added to its
+// lane along with its neighbor's word, and every HASH_BLOCK stripes the lanes
+// are scrambled so the products don't pile up in their low bits. The vector
+// and scalar versions compute the same function, so hashes (like the one in
+// a trace's header) don't depend on the CPU.
+static const uint64_t HASH_KEY[4] = {
+    0xbe4ba423396cfeb8UL, 0x1cad21f72c81017cUL,
+    0xdb979083e96dd4deUL, 0x1f67b3b7a4a44072UL,
+};
+static const uint64_t HASH_INIT[4] = {
+    0x165667b19e3779f9UL, 0x9e3779b185ebca87UL,
+    0xc2b2ae3d27d4eb4fUL, 0x85ebca77c2b2ae63UL,
+};
+static const uint32_t HASH_PRIME = 0x9e3779b1;
+static const size_t HASH_BLOCK = 16;
+
+static void stripe_scalar(uint64_t acc[4], const char* p) {
+    uint64_t w[4];
+    memcpy(w, p, sizeof w);
+    for (int j = 0; j < 4; ++j) {
+        uint64_t k = w[j] ^ HASH_KEY[j];
+        acc[j] += (k & 0xffffffff) * (k >> 32) + w[j ^ 1];
+    }
+}
+
+static void scramble_scalar(uint64_t acc[4]) {
+    for (int j = 0; j < 4; ++j) {
+        acc[j] = (acc[j] ^ acc[j] >> 47 ^ HASH_KEY[j]) * HASH_PRIME;
+    }
+}
+
+// Fold the lanes and the length together
+static uint64_t hash_finish(const uint64_t acc[4], size_t n) {
+    uint64_t h = n * 0x9e3779b97f4a7c15UL;
+    for (int j = 0; j < 4; ++j) h = (h ^ mix(acc[j])) * 0x9e3779b97f4a7c15UL;
+    return mix(h);
+}
+
+// The last partial stripe, zero-padded (the length is hashed in separately)
+static void stripe_tail(uint64_t acc[4], const char* p, size_t n) {
+    char last[32] = {0};
+    memcpy(last, p, n);
+    stripe_scalar(acc, last);
+}
+
+static uint64_t hash_scalar(const char* p, size_t n) {
+    uint64_t acc[4] = {HASH_INIT[0], HASH_INIT[1], HASH_INIT[2], HASH_INIT[3]};
+    size_t i = 0;
+    for (size_t s = 1; i + 32 <= n; i += 32, ++s) {
+        stripe_scalar(acc, p + i);
+        if (s % HASH_BLOCK == 0) scramble_scalar(acc);
+    }
+    if (i < n) stripe_tail(acc, p + i, n - i);
+    return hash_finish(acc, n);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static uint64_t hash_avx2(const char* p, size_t n) {
+    __m256i acc = _mm256_loadu_si256((const __m256i*) HASH_INIT);
+    const __m256i key = _mm256_loadu_si256((const __m256i*) HASH_KEY);
+    const __m256i prime = _mm256_set1_epi64x(HASH_PRIME);
+    size_t i = 0;
+    for (size_t s = 1; i + 32 <= n; i += 32, ++s) {
+        __m256i w = _mm256_loadu_si256((const __m256i*) (p + i));
+        __m256i k = _mm256_xor_si256(w, key);
+        __m256i prod = _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32));
+        // Swap neighboring words, as w[j ^ 1] does
+        __m256i swapped = _mm256_permute4x64_epi64(w, 0xb1);
+        acc = _mm256_add_epi64(acc, _mm256_add_epi64(prod, swapped));
+        if (s % HASH_BLOCK == 0) {
+            acc = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+            acc = _mm256_xor_si256(acc, key);
+            // A 64-bit by 32-bit multiply, from two 32-bit halves
+            __m256i lo = _mm256_mul_epu32(acc, prime);
+            __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime);
+            acc = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
         }
-        if (!n.messages.size()) terminating.insert(n);
     }
-    return ret;
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*) lanes, acc);
+    if (i < n) stripe_tail(lanes, p + i, n - i);
+    return hash_finish(lanes, n);
 }
 
-// To construct a Model from an initial state and some invariants, run all of
-// the machines' initialization tasks.
-Model::Model(std::vector<Machine*> m, std::vector<Predicate> i) : invariants(i) {
-    SystemState s{m};
+static bool has_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
 
-    // All models have error handling invariants
-    invariants.emplace_back("Valid messages", [] (const SystemState& s) {
-        for (Machine* const& m : s.machines) {
-            if (m->error == ERR_BADMSG) return false;
+static uint64_t (*hash_kernel)(const char*, size_t) = hash_scalar;
+
+void bytes_kernels(bool vector) {
+    hash_kernel = hash_scalar;
+#if defined(__x86_64__)
+    if (vector && has_avx2()) hash_kernel = hash_avx2;
+#endif
+}
+
+// Choose the kernel once at startup
+static const bool kernel_chosen = (bytes_kernels(true), true);
+
+uint64_t bytes_hash(const char* p, size_t n) {
+    return hash_kernel(p, n);
+}
+
+// glibc's memcmp is already chosen at load time for the CPU's vector
+// instructions, and measured (with bench) faster than a hand-written AVX2
+// loop, so these just use it
+bool bytes_equal(const char* a, const char* b, size_t n) {
+    return !memcmp(a, b, n);
+}
+
+int bytes_compare(const char* a, const char* b, size_t n) {
+    return memcmp(a, b, n);
+}
+
+static size_t tree_size(MessageList::Node* t) {
+    return t ? t->size : 0;
+}
+
+static int tree_height(MessageList::Node* t) {
+    return t ? t->height : 0;
+}
+
+Message* MessageList::operator[](size_t i) const {
+    Node* t = root;
+    for (;;) {
+        size_t l = tree_size(t->left);
+        if (i < l) {
+            t = t->left;
+        } else if (i < l + t->count) {
+            return t->msgs[i - l];
+        } else {
+            i -= l + t->count;
+            t = t->right;
         }
-        return true;
-    });
+    }
+}
 
-    // Initialize machines
-    for (Machine*& m : s.machines) {
-        std::vector<Message*> new_msg = m->on_startup();
-        s.messages.insert(s.messages.end(), new_msg.begin(), new_msg.end());
+void MessageList::insert(size_t i, Message* m) {
+    Node* t = add(root, i, m);
+    release(root, counted);
+    root = t;
+}
+
+void MessageList::erase(size_t i) {
+    Node* t = remove(root, i);
+    release(root, counted);
+    root = t;
+}
+
+void MessageList::release(Node* t, bool counted) {
+    if (!t || --t->refs) return;
+    release(t->left, counted);
+    release(t->right, counted);
+    if (counted) {
+        for (int j = 0; j < t->count; ++j) t->msgs[j]->ref_dec();
     }
+    delete t;
+}
 
-    // Visit the initial state first.
-    pending.push_back(s);
+MessageList::Node* MessageList::make(Node* l, Chunk c, Node* r) const {
+    Node* t = new Node;
+    t->refs = 1;
+    t->left = l;
+    t->right = r;
+    t->size = tree_size(l) + tree_size(r) + c.count;
+    t->height = std::max(tree_height(l), tree_height(r)) + 1;
+    t->count = c.count;
+    for (int j = 0; j < c.count; ++j) {
+        t->msgs[j] = c.msgs[j];
+        if (counted) c.msgs[j]->ref_inc();
+    }
+    return t;
+}
 
-    //printf("Initialized a new model with %lu machines and %lu invariants.\n",
-    //       s.machines.size(), invariants.size());
+// Join `l`, `c` and `r`, whose heights differ by at most 2, with a rotation or
+// two if need be
+MessageList::Node* MessageList::balance(Node* l, Chunk c, Node* r) const {
+    Node* t;
+    if (tree_height(l) > tree_height(r) + 1) {
+        if (tree_height(l->left) >= tree_height(l->right)) {
+            t = make(share(l->left), chunk(l), make(share(l->right), c, r));
+        } else {
+            Node* lr = l->right;
+            t = make(make(share(l->left), chunk(l), share(lr->left)),
+                     chunk(lr), make(share(lr->right), c, r));
+        }
+        release(l, counted);
+    } else if (tree_height(r) > tree_height(l) + 1) {
+        if (tree_height(r->right) >= tree_height(r->left)) {
+            t = make(make(l, c, share(r->left)), chunk(r), share(r->right));
+        } else {
+            Node* rl = r->left;
+            t = make(make(l, c, share(rl->left)), chunk(rl),
+                     make(share(rl->right), chunk(r), share(r->right)));
+        }
+        release(r, counted);
+    } else {
+        t = make(l, c, r);
+    }
+    return t;
 }
 
-std::set<SystemState> Model::run(int max_depth, bool exclude_symmetries,
-                                 std::vector<Predicate> interesting_states,
-                                 bool print) {
-    std::set<SystemState> terminating;
-    int depth = 0;
-    size_t nodes_seen = 0;
+MessageList::Node* MessageList::add(Node* t, size_t i, Message* m) const {
+    if (!t) return make(nullptr, Chunk{&m, 1}, nullptr);
+    size_t l = tree_size(t->left);
+    if (i < l) return balance(add(t->left, i, m), chunk(t), share(t->right));
+    if (i > l + t->count) {
+        return balance(share(t->left), chunk(t),
+                       add(t->right, i - l - t->count, m));
+    }
+    // It goes in this node; if that overflows it, the last message moves on
+    // to the start of the right subtree
+    Message* msgs[CHUNK + 1];
+    Message** end = std::copy(t->msgs, t->msgs + (i - l), msgs);
+    *end = m;
+    std::copy(t->msgs + (i - l), t->msgs + t->count, end + 1);
+    if (t->count < CHUNK) {
+        return make(share(t->left), Chunk{msgs, t->count + 1},
+                    share(t->right));
+    }
+    return balance(share(t->left), Chunk{msgs, CHUNK},
+                   add(t->right, 0, msgs[CHUNK]));
+}
 
-    while ((max_depth < 0 || depth <= max_depth) && !pending.empty()) {
-        if (print) {
-            printf("Depth searched: %d\n    Total nodes explored: %lu\n"
-                   "    Unique nodes visited: %lu\n    Frontier size: %lu\n",
-                   depth, nodes_seen, visited.size(), pending.size());
-            printf("    Sample queue length: %lu\n", pending[0].messages.size());
-            printf("    Terminating states found: %lu\n", terminating.size());
+MessageList::Node* MessageList::remove(Node* t, size_t i) const {
+    size_t l = tree_size(t->left);
+    if (i < l) return balance(remove(t->left, i), chunk(t), share(t->right));
+    if (i >= l + t->count) {
+        return balance(share(t->left), chunk(t),
+                       remove(t->right, i - l - t->count));
+    }
+    if (t->count > 1) {
+        Message* msgs[CHUNK];
+        Message** end = std::copy(t->msgs, t->msgs + (i - l), msgs);
+        std::copy(t->msgs + (i - l) + 1, t->msgs + t->count, end);
+        return make(share(t->left), Chunk{msgs, t->count - 1},
+                    share(t->right));
+    }
+    // This node empties, so replace it with the first node after it
+    if (!t->left) return share(t->right);
+    if (!t->right) return share(t->left);
+    Node* first = t->right;
+    while (first->left) first = first->left;
+    return balance(share(t->left), chunk(first), remove_first(t->right));
+}
+
+// Remove the first node of `t`
+MessageList::Node* MessageList::remove_first(Node* t) const {
+    if (!t->left) return share(t->right);
+    return balance(remove_first(t->left), chunk(t), share(t->right));
+}
+
+// The order of messages in SystemState's buckets (and so in LogicalState's,
+// unless every message is treated as fifo): fifo messages after all the
+// others (which are sorted), grouped by channel
+static bool bucket_less(Message* a, Message* b, bool outgoing) {
+    if (a->fifo != b->fifo) return a->fifo < b->fifo;
+    if (a->fifo) return outgoing ? a->dst < b->dst : a->src < b->src;
+    return a->logical_compare(b) < 0;
+}
+
+// Insert `m` into `bucket` after everything that doesn't sort after it, so
+// fifo messages stay in the order they were sent
+static void bucket_add(MessageList& bucket, Message* m, bool outgoing) {
+    size_t lo = 0, hi = bucket.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (bucket_less(m, bucket[mid], outgoing)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    bucket.insert(lo, m);
+}
+
+// Remove the first `m` in `bucket`; it's the oldest, so the one taken if it's
+// fifo and was duplicated
+static void bucket_remove(MessageList& bucket, Message* m, bool outgoing) {
+    size_t lo = 0, hi = bucket.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (bucket_less(bucket[mid], m, outgoing)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
+    while (bucket[lo] != m) ++lo;
+    bucket.erase(lo);
+}
 
-        for (const SystemState& s : pending) {
-            ++nodes_seen;
+void SystemState::bucket(bool on) {
+    incoming.clear();
+    outgoing.clear();
+    if (!on) return;
+    incoming.resize(machines.size());
+    outgoing.resize(machines.size());
+    for (Message* m : messages) {
+        bucket_add(incoming[m->dst], m, false);
+        bucket_add(outgoing[m->src], m, true);
+    }
+}
 
-            // Note that we only care about the states we've visited, not how we
-            // got there; since this is a BFS, the history should always be the
-            // most minimal possible
-            visited.insert(s);
+void SystemState::send(Message* m) {
+    messages.push_back(m);
+    if (incoming.empty()) return;
+    bucket_add(incoming[m->dst], m, false);
+    bucket_add(outgoing[m->src], m, true);
+}
 
-            // Ensure that `s` validates against all invariants
-            for (const Predicate& p : invariants) {
-                if (!p.match(s)) {
-                    printf("INVARIANT VIOLATED: %s\n", p.name);
-                    s.print_history();
-                    exit(1);
+void SystemState::take(size_t i) {
+    Message* m = messages[i];
+    if (!incoming.empty()) {
+        bucket_remove(incoming[m->dst], m, false);
+        bucket_remove(outgoing[m->src], m, true);
+    }
+    messages.erase(i);
+}
+
+bool Message::sub_flatten(std::string& out) const {
+    // A subclass which didn't override this would flatten like a plain
+    // Message, identifying states which differ in its fields
+    return typeid(*this) == typeid(Message);
+}
+
+// Pad `out` with zeroes to a multiple of 8 bytes
+static void flat_align(std::string& out) {
+    out.resize((out.size() + 7) & ~(size_t) 7, 0);
+}
+
+// Encode `s` into `f` as FlatState's constructor does, for any state with a
+// SystemState's machines, messages and fault counts (such as a random walk's)
+template <typename S>
+static void flatten_state(FlatState& f, const S& s,
+                          const std::vector<id_t>& to) {
+    std::string& buf = f.buf;
+    bool& ok = f.ok;
+    buf.clear();
+    ok = true;
+    uint32_t machines = s.machines.size(), messages = s.messages.size();
+    flat_put(buf, machines);
+    flat_put(buf, messages);
+    // Leave room for the offset table, then fill it in as records are added
+    size_t table = buf.size();
+    buf.resize(table + (machines + messages) * sizeof(uint32_t));
+    flat_align(buf);
+    uint32_t k = 0;
+    auto record = [&] () {
+        uint32_t off = buf.size();
+        memcpy(&buf[table + k++ * sizeof off], &off, sizeof off);
+    };
+    auto machine = [&] (const Machine* m) {
+        record();
+        flat_put(buf, m->id);
+        flat_put(buf, m->type);
+        flat_put(buf, m->timers);
+        ok = ok && m->sub_flatten(buf);
+        flat_align(buf);
+    };
+    if (to.empty()) {
+        for (Machine* const& m : s.machines) machine(m);
+    } else {
+        std::vector<Machine*> from(machines);
+        for (uint32_t j = 0; j < machines; ++j) from[to[j]] = s.machines[j];
+        for (Machine* m : from) {
+            Machine* c = m->copy();
+            c->id = to[m->id];
+            c->sub_remap(to);
+            machine(c);
+            c->ref_dec();
+        }
+    }
+    for (Message* const& m : s.messages) {
+        record();
+        flat_put(buf, to.empty() ? m->src : to[m->src]);
+        flat_put(buf, to.empty() ? m->dst : to[m->dst]);
+        flat_put(buf, m->type);
+        ok = ok && m->sub_flatten(buf);
+        flat_align(buf);
+    }
+    flat_put(buf, s.drops);
+    flat_put(buf, s.dups);
+    flat_put(buf, s.crashes);
+    flat_align(buf);
+    if (!ok) buf.clear();
+}
+
+FlatState::FlatState(const SystemState& s, const std::vector<id_t>& to) {
+    flatten_state(*this, s, to);
+}
+
+// Slot values in a StateTable: empty, sealed, or a record's address with the
+// top 16 bits of its hash above it
+static const uint64_t SLOT_EMPTY = 0;
+static const uint64_t SLOT_SEALED = 1;
+static const int SLOT_TAG = 48;
+
+static StateTable::Record* slot_record(uint64_t v) {
+    return (StateTable::Record*) (v & ((1UL << SLOT_TAG) - 1));
+}
+
+static bool slot_matches(uint64_t v, uint64_t hash, const FlatState& s) {
+    if (v >> SLOT_TAG != hash >> SLOT_TAG) return false;
+    const StateTable::Record* r = slot_record(v);
+    return r->hash == hash && r->size == s.buf.size()
+        && bytes_equal(r->bytes, s.buf.data(), r->size);
+}
+
+char* Arena::alloc(size_t n) {
+    static const size_t BLOCK_SIZE = 1 << 20;
+    n = (n + 7) & ~(size_t) 7;
+    for (;;) {
+        Block* b = top.load(std::memory_order_acquire);
+        if (b) {
+            size_t off = b->used.fetch_add(n, std::memory_order_relaxed);
+            if (off + n <= b->cap) return b->data + off;
+        }
+        // Out of room: start a new block, unless someone else just did
+        size_t cap = std::max(n, BLOCK_SIZE);
+        Block* fresh = new (::operator new(sizeof(Block) + cap)) Block;
+        fresh->prev = b;
+        fresh->cap = cap;
+        fresh->used.store(n, std::memory_order_relaxed);
+        if (top.compare_exchange_strong(b, fresh, std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+            return fresh->data;
+        }
+        fresh->~Block();
+        ::operator delete(fresh);
+    }
+}
+
+void Arena::clear() {
+    Block* b = top.exchange(nullptr);
+    while (b) {
+        Block* prev = b->prev;
+        b->~Block();
+        ::operator delete(b);
+        b = prev;
+    }
+}
+
+StateTable::Table::Table(size_t size)
+    : mask(size - 1), slots(new std::atomic<uint64_t>[size]()), next(nullptr),
+      used(0), claimed(0), moved(0), below(nullptr) {}
+
+struct StateTable::Use {
+    const StateTable& table;
+
+    Use(const StateTable& t) : table(t) {
+        table.active.fetch_add(1);
+    }
+    ~Use() {
+        table.leave();
+    }
+};
+
+StateTable::~StateTable() {
+    free_tables();
+}
+
+// Free a stack of retired tables
+static void free_retired(StateTable::Table* t) {
+    while (t) {
+        StateTable::Table* below = t->below;
+        delete t;
+        t = below;
+    }
+}
+
+void StateTable::free_tables() {
+    free_retired(retired.exchange(nullptr));
+    for (Table* t = oldest.exchange(nullptr); t;) {
+        Table* next = t->next;
+        delete t;
+        t = next;
+    }
+}
+
+void StateTable::leave() const {
+    if (active.fetch_sub(1) != 1 || !retired.load()) return;
+    Table* t = retired.exchange(nullptr);
+    if (!t) return;
+    // Whoever might still be reading these tables started before they were
+    // retired, so has finished if nobody is running now
+    if (active.load() == 0) {
+        free_retired(t);
+        return;
+    }
+    // Otherwise put them back for whoever leaves last
+    Table* bottom = t;
+    while (bottom->below) bottom = bottom->below;
+    Table* top = retired.load();
+    do {
+        bottom->below = top;
+    } while (!retired.compare_exchange_weak(top, t));
+}
+
+void StateTable::clear() {
+    free_tables();
+    count = 0;
+    arena.clear();
+}
+
+StateTable::Table* StateTable::start() {
+    Table* t = oldest.load(std::memory_order_acquire);
+    if (t) return t;
+    Table* fresh = new Table(INITIAL_SIZE);
+    if (oldest.compare_exchange_strong(t, fresh, std::memory_order_acq_rel,
+                                       std::memory_order_acquire)) {
+        return fresh;
+    }
+    delete fresh;
+    return t;
+}
+
+StateTable::Record* StateTable::find(const FlatState& s) const {
+    Use use{*this};
+    uint64_t hash = bytes_hash(s.buf.data(), s.buf.size());
+    for (Table* t = oldest.load(std::memory_order_acquire); t;
+         t = t->next.load(std::memory_order_acquire)) {
+        size_t i = hash & t->mask;
+        for (size_t n = 0; n <= t->mask; ++n, i = (i + 1) & t->mask) {
+            uint64_t v = t->slots[i].load(std::memory_order_acquire);
+            if (v == SLOT_EMPTY) return nullptr;
+            if (v == SLOT_SEALED) break;
+            if (slot_matches(v, hash, s)) return slot_record(v);
+        }
+    }
+    return nullptr;
+}
+
+std::pair<StateTable::Record*, bool> StateTable::insert(const FlatState& s,
+                                                        int delay) {
+    Use use{*this};
+    help();
+    // Look first, so that only a lost race wastes space in the arena
+    if (Record* r = find(s)) return {r, false};
+
+    uint64_t hash = bytes_hash(s.buf.data(), s.buf.size());
+    Record* r = new (arena.alloc(sizeof(Record) + s.buf.size())) Record;
+    r->hash = hash;
+    r->delay.store(delay, std::memory_order_relaxed);
+    r->size = s.buf.size();
+    memcpy(r->bytes, s.buf.data(), r->size);
+
+    uint64_t v = hash >> SLOT_TAG << SLOT_TAG | (uintptr_t) r;
+    uint64_t got = place(start(), hash, v, &s);
+    if (got != v) return {slot_record(got), false};
+    count.fetch_add(1, std::memory_order_relaxed);
+    return {r, true};
+}
+
+uint64_t StateTable::place(Table* t, uint64_t hash, uint64_t v,
+                           const FlatState* s) {
+    for (;;) {
+        size_t i = hash & t->mask;
+        for (size_t n = 0; n <= t->mask; ++n, i = (i + 1) & t->mask) {
+            uint64_t cur = t->slots[i].load(std::memory_order_acquire);
+            while (cur == SLOT_EMPTY) {
+                if (t->slots[i].compare_exchange_weak(
+                        cur, v, std::memory_order_acq_rel,
+                        std::memory_order_acquire)) {
+                    size_t used = t->used.fetch_add(1) + 1;
+                    if (used > (t->mask + 1) / 4 * 3) grow(t);
+                    return v;
                 }
             }
+            if (cur == SLOT_SEALED) break;
+            // Records being moved are unique, so only need to find themselves
+            if (s ? slot_matches(cur, hash, *s) : cur == v) return cur;
+        }
+        grow(t);
+        t = t->next.load(std::memory_order_acquire);
+    }
+}
 
-            // Guided search; if a state matches any of the `interesting`
-            // predicates, start over from that state
-            for (const Predicate& p : interesting_states) {
-                if (p.match(s)) {
-                    printf("INTERESTING STATE FOUND: %s\n", p.name);
-                    pending.clear();
-                    pending.push_back(s);
-                    break;
-                }
+void StateTable::grow(Table* t) {
+    if (t->next.load(std::memory_order_acquire)) return;
+    Table* bigger = new Table(2 * (t->mask + 1));
+    Table* expected = nullptr;
+    if (!t->next.compare_exchange_strong(expected, bigger)) delete bigger;
+}
+
+void StateTable::help() {
+    for (Table* t = oldest.load(std::memory_order_acquire); t;
+         t = t->next.load(std::memory_order_acquire)) {
+        Table* next = t->next.load(std::memory_order_acquire);
+        if (!next || t->claimed.load(std::memory_order_relaxed) >= t->chunks()) {
+            continue;
+        }
+        size_t c = t->claimed.fetch_add(1);
+        if (c >= t->chunks()) continue;
+
+        for (size_t i = c << CHUNK_BITS; i < (c + 1) << CHUNK_BITS; ++i) {
+            uint64_t cur = SLOT_EMPTY;
+            if (t->slots[i].compare_exchange_strong(cur, SLOT_SEALED)) continue;
+            place(next, slot_record(cur)->hash, cur, nullptr);
+        }
+        if (t->moved.fetch_add(1) + 1 == t->chunks()) retire();
+        return;
+    }
+}
+
+void StateTable::retire() {
+    for (;;) {
+        Table* t = oldest.load(std::memory_order_acquire);
+        Table* next = t->next.load(std::memory_order_acquire);
+        if (!next || t->moved.load(std::memory_order_acquire) < t->chunks()) {
+            return;
+        }
+        if (!oldest.compare_exchange_strong(t, next)) continue;
+        t->below = retired.load();
+        while (!retired.compare_exchange_weak(t->below, t)) {}
+    }
+}
+
+// Hash `buf` (as padded for bytes_hash), then clear it for reuse
+static uint64_t take_hash(std::string& buf) {
+    flat_align(buf);
+    uint64_t h = bytes_hash(buf.data(), buf.size());
+    buf.clear();
+    return h;
+}
+
+// The number of distinct values in `v`
+static size_t distinct(std::vector<uint64_t> v) {
+    std::sort(v.begin(), v.end());
+    return std::unique(v.begin(), v.end()) - v.begin();
+}
+
+// At most this many renamings are tried to break ties between a state's
+// machines (see canonical)
+static const size_t MAX_TIES = 24;
+
+// The encoding of `s` in canonical form under the symmetry `groups` (see
+// Model::symmetries). Each machine is hashed by its contents (its group's
+// members without their ids, and the others by id alone), then the hashes
+// are refined by those of the machines each exchanges messages with until
+// that splits them no further; every group's members are then given its ids
+// in order of their hashes. Members whose hashes still tie (like identical
+// nodes which other machines hold different ids of) are tried in every order
+// and the least encoding kept, unless there are more than MAX_TIES orders,
+// when they're left in id order. That only costs reduction: the result is
+// always a renaming of `s`, so it's sound whatever the hashes are.
+static FlatState canonical(const SystemState& s,
+                           const std::vector<std::vector<id_t>>& groups) {
+    size_t n = s.machines.size();
+    std::vector<uint64_t> h(n);
+    for (size_t j = 0; j < n; ++j) h[j] = mix(~(uint64_t) j);
+    std::string buf;
+    for (size_t g = 0; g < groups.size(); ++g) {
+        for (id_t j : groups[g]) {
+            Machine* m = s.machines[j];
+            flat_put(buf, g);
+            flat_put(buf, m->type);
+            flat_put(buf, m->timers);
+            if (!m->sub_flatten(buf)) return FlatState{};
+            h[j] = take_hash(buf);
+        }
+    }
+    std::vector<uint64_t> hm;
+    hm.reserve(s.messages.size());
+    for (Message* m : s.messages) {
+        flat_put(buf, m->type);
+        if (!m->sub_flatten(buf)) return FlatState{};
+        hm.push_back(take_hash(buf));
+    }
+
+    // Summing over each machine's messages makes it independent of their
+    // order; a message is counted at both ends, told apart by direction
+    size_t classes = distinct(h);
+    for (size_t round = 0; round < n && classes < n; ++round) {
+        std::vector<uint64_t> next(h);
+        size_t i = 0;
+        for (Message* m : s.messages) {
+            next[m->dst] += mix(hm[i] ^ h[m->src]);
+            next[m->src] += mix(~hm[i] ^ h[m->dst]);
+            ++i;
+        }
+        for (uint64_t& x : next) x = mix(x);
+        size_t c = distinct(next);
+        if (c == classes) break;
+        h = std::move(next);
+        classes = c;
+    }
+
+    // Each group's members in order of their hashes, and the runs of them
+    // which tie
+    std::vector<std::vector<id_t>> orders, ids;
+    std::vector<std::pair<id_t*, id_t*>> ties;
+    size_t tries = 1;
+    for (const std::vector<id_t>& group : groups) {
+        orders.push_back(group);
+        std::sort(orders.back().begin(), orders.back().end(),
+                  [&h] (id_t a, id_t b) {
+            return h[a] != h[b] ? h[a] < h[b] : a < b;
+        });
+        ids.push_back(group);
+        std::sort(ids.back().begin(), ids.back().end());
+    }
+    for (std::vector<id_t>& order : orders) {
+        for (size_t b = 0, e; b < order.size(); b = e) {
+            for (e = b + 1; e < order.size() && h[order[e]] == h[order[b]]; ++e) {
+                tries *= e - b + 1;
             }
+            if (e - b > 1) ties.emplace_back(&order[b], &order[e]);
         }
-        pending = get_all_neighbors(pending, exclude_symmetries,
-                                    terminating, visited);
-        ++depth;
     }
-    printf("Terminating depth: %d\n", depth - 1);
-    printf("Total nodes explored: %lu\n", nodes_seen);
-    return terminating;
+    if (tries > MAX_TIES) ties.clear();
+
+    auto encode = [&] () {
+        std::vector<id_t> to(n);
+        bool identity = true;
+        for (size_t j = 0; j < n; ++j) to[j] = j;
+        for (size_t g = 0; g < orders.size(); ++g) {
+            for (size_t k = 0; k < orders[g].size(); ++k) {
+                to[orders[g][k]] = ids[g][k];
+                if (orders[g][k] != ids[g][k]) identity = false;
+            }
+        }
+        if (identity) to.clear();
+        return FlatState{s, to};
+    };
+    FlatState best = encode();
+    // Step through the orders of every run of ties, like an odometer (each
+    // wraps around to id order after its last)
+    for (;;) {
+        size_t t = 0;
+        while (t < ties.size()
+               && !std::next_permutation(ties[t].first, ties[t].second)) {
+            ++t;
+        }
+        if (t == ties.size()) break;
+        FlatState f = encode();
+        if (f.buf < best.buf) best = std::move(f);
+    }
+    return best;
+}
+
+FlatState Visited::key(const SystemState& s) const {
+    if (!symmetries) return FlatState{s};
+    return canonical(s, *symmetries);
+}
+
+bool Visited::seen(const SystemState& s, bool bounded) const {
+    if (flat || symmetries) {
+        FlatState k = key(s);
+        if (k.ok) return seen(k, s.delay, bounded);
+    }
+    auto it = states.find(s);
+    return it != states.end() && (!bounded || it->delay <= s.delay);
+}
+
+bool Visited::seen(const FlatState& key, int delay, bool bounded) const {
+    StateTable::Record* r = flats.find(key);
+    return r && (!bounded || r->delay.load(std::memory_order_relaxed) <= delay);
+}
+
+void Visited::visit(const SystemState& s) {
+    FlatState k;
+    if (flat || symmetries) k = key(s);
+    if (k.ok) {
+        auto [r, added] = flats.insert(k, s.delay);
+        int d = r->delay.load(std::memory_order_relaxed);
+        while (!added && s.delay < d
+               && !r->delay.compare_exchange_weak(d, s.delay)) {}
+        return;
+    }
+    auto [it, added] = states.insert(s);
+    if (!added && s.delay < it->delay) {
+        states.erase(it);
+        states.insert(s);
+    }
+}
+
+// The states reached so far within a layer (or for best-first search, at
+// all), up to symmetry: as LogicalStates, or if the model declares
+// symmetries, as canonical encodings (or whole, for states without one).
+// Each is kept with the least delay it was reached with, as Visited does.
+struct Reached {
+    std::map<LogicalState, int> logical;
+    std::map<std::string, int> canonical;
+    std::map<SystemState, int> states;
+
+    // Record `key`, reached with `delay`; returns whether it's new, or (if
+    // delays are bounded) was only reached before with a greater delay
+    template <typename K>
+    static bool add(std::map<K, int>& seen, K key, int delay, bool bounded) {
+        auto [it, added] = seen.emplace(std::move(key), delay);
+        if (added) return true;
+        if (!bounded || delay >= it->second) return false;
+        it->second = delay;
+        return true;
+    }
+};
+
+// The distinct terminating states a search reaches, counted in the Result and
+// passed to Model::on_terminal as they're found
+struct Terminals {
+    Model& model;
+    Result& res;
+    // The flat encodings of those not kept in the Result, or the states
+    // themselves if they have none
+    StateTable flats;
+    std::set<SystemState> states;
+
+    Terminals(Model& m, Result& r) : model(m), res(r) {}
+
+    void add(const SystemState& s) {
+        if (model.keep_terminating) {
+            if (!res.terminating.insert(s).second) return;
+        } else {
+            FlatState f{s};
+            if (f.ok ? !flats.insert(f, 0).second : !states.insert(s).second) {
+                return;
+            }
+        }
+        ++res.terminated;
+        if (model.on_terminal) model.on_terminal(s);
+    }
+    size_t size() const {
+        return res.terminated;
+    }
+};
+
+// If `how` is given, the node and transition each neighbor was reached by are
+// appended to it
+template <bool profiled>
+std::vector<SystemState> get_all_neighbors(std::vector<SystemState>& nodes,
+                                           bool exclude_symmetries,
+                                           Terminals& terminating,
+                                           Visited& visited,
+                                           Reached& reached,
+                                           Model& model,
+                                           std::vector<std::pair<size_t, size_t>>*
+                                               how = nullptr) {
+    std::vector<SystemState> ret;
+    bool bounded = model.delay_bound >= 0;
+
+    for (size_t p = 0; p < nodes.size(); ++p) {
+        const SystemState& n = nodes[p];
+        size_t messages = 3 * n.messages.size();
+        for (size_t k = 0; k < transitions(n); ++k) {
+            // Taking message `i` skips over the `i` older messages before it;
+            // later messages would skip even more, so go on to the machines
+            if (bounded && k < messages
+                && n.delay + (int) (k / 3) > model.delay_bound) {
+                k = messages - 1;
+                continue;
+            }
+            if (!enabled(model, n, k)) continue;
+
+            Diff* d = new Diff();
+            SystemState next = successor<profiled>(model, n, k, d);
+            if (stutters(n, next, d)) {
+                d->ref_dec();
+                continue;
+            }
+
+            // And if this is a new state, add it to the list
+            bool fresh;
+            FlatState key;
+            if (exclude_symmetries && visited.symmetries) {
+                key = visited.key(next);
+            }
+            if (key.ok) {
+                fresh = !visited.seen(key, next.delay, bounded)
+                    && Reached::add(reached.canonical, std::move(key.buf),
+                                    next.delay, bounded);
+            } else if (exclude_symmetries && visited.symmetries) {
+                fresh = !visited.seen(next, bounded)
+                    && Reached::add(reached.states, next, next.delay, bounded);
+            } else {
+                fresh = !visited.seen(next, bounded);
+                if (fresh && exclude_symmetries) {
+                    fresh = Reached::add(reached.logical,
+                                         LogicalState{next, model.fifo},
+                                         next.delay, bounded);
+                }
+            }
+            if (fresh) {
+                next.history.push_back(d);
+                ret.push_back(next);
+                if (how) how->emplace_back(p, k);
+            } else {
+                d->ref_dec();
+            }
+        }
+        if (n.terminated()) terminating.add(n);
+    }
+    return ret;
+}
+
+// Return the first invariant `s` fails, or nullptr if it satisfies all of them
+static const Predicate* violated(const std::vector<Predicate>& invariants,
+                                 const SystemState& s) {
+    for (const Predicate& p : invariants) {
+        if (!p.match(s)) return &p;
+    }
+    return nullptr;
+}
+
+// The whole of `s`, for the invariants which can only check that
+static const SystemState& whole(const SystemState& s) {
+    return s;
+}
+struct WalkState;
+static const SystemState& whole(const WalkState& s);
+
+// Likewise, for a state reached from one which satisfied them all by a step
+// which changed machine `changed` (if any) and sent `sent`: the invariants
+// over machines or messages are only checked on those
+template <typename S>
+static const Predicate* violated(const std::vector<Predicate>& invariants,
+                                 const S& s, long changed,
+                                 const std::vector<Message*>& sent) {
+    for (const Predicate& p : invariants) {
+        if (p.machine) {
+            if (changed >= 0 && !p.machine(s.machines[changed])) return &p;
+        } else if (p.among) {
+            if (changed >= 0 && !p.among(s.machines, changed)) return &p;
+        } else if (p.message) {
+            for (Message* m : sent) {
+                if (!p.message(m)) return &p;
+            }
+        } else if (!p.match(whole(s))) {
+            return &p;
+        }
+    }
+    return nullptr;
+}
+
+// Likewise, for a state reached by `d` (or the whole state, if none)
+static const Predicate* violated(const std::vector<Predicate>& invariants,
+                                 const SystemState& s, const Diff* d) {
+    if (!d) return violated(invariants, s);
+    long changed = d->delivered ? (long) d->delivered->dst
+        : d->restarted >= 0 ? d->restarted : d->fired;
+    return violated(invariants, s, changed, d->sent);
+}
+
+// The step that reached `s`, if it has a history
+static const Diff* last_step(const SystemState& s) {
+    return s.history.empty() ? nullptr : s.history.back();
+}
+
+// Whether the search recording into `res` has been told to stop
+static bool cancelled(Model& model, Result& res) {
+    return res.stopped = model.cancel.load(std::memory_order_relaxed);
+}
+
+// Record that `s` (with its history) violates `p`, stopping every search once
+// there are max_violations; returns whether this search should stop
+static bool record(Model& model, Result& res, const Predicate* p,
+                   const SystemState& s) {
+    res.violations.push_back(Violation{*p, s});
+    if (model.max_violations
+        && res.violations.size() >= model.max_violations) {
+        model.cancel = true;
+    }
+    return cancelled(model, res);
+}
+
+// Whether `s` has already been found to violate an invariant (as iterative
+// deepening, or a later delay bound, will find it again)
+static bool known(const Result& res, const SystemState& s) {
+    for (const Violation& v : res.violations) {
+        if (v.state == s) return true;
+    }
+    return false;
+}
+
+// Likewise, printing it first, unless it's known
+static bool report(Model& model, Result& res, const Predicate* p,
+                   const SystemState& s) {
+    if (known(res, s)) return cancelled(model, res);
+    printf("INVARIANT VIOLATED: %s\n", p->name);
+    s.print_history();
+    return record(model, res, p, s);
+}
+
+void Profile::print() const {
+    printf("%8s %8s %12s %14s %14s %12s %12s\n", "machine", "message",
+           "calls", "handle ns", "clone ns", "sent", "unchanged");
+    for (auto& [key, h] : handlers) {
+        printf("%8d %8d %12lu %14lu %14lu %12lu %12lu\n", key.first,
+               key.second, h.calls, h.handle_ns, h.clone_ns, h.sent,
+               h.unchanged);
+    }
+}
+
+// To construct a Model from an initial state and some invariants, run all of
+// the machines' initialization tasks.
+Model::Model(std::vector<Machine*> m, std::vector<Predicate> i)
+    : initial(std::vector<Machine*>{}), invariants(i), profiling(false),
+      delay_bound(-1), fifo(false),
+      max_drops(-1), max_dups(0), max_crashes(0), max_violations(1),
+      cancel(false), keep_terminating(true) {
+    SystemState s{m};
+
+    // All models have error handling invariants
+    invariants.emplace_back("Valid messages", [] (Machine* m) {
+        return m->error != ERR_BADMSG;
+    });
+
+    // Initialize machines
+    for (Machine*& m : s.machines) {
+        for (Message* msg : m->on_startup()) {
+            s.send(msg);
+            msg->ref_dec();
+        }
+    }
+
+    // Visit the initial state first.
+    initial = s;
+    pending.push_back(s);
+
+    //printf("Initialized a new model with %lu machines and %lu invariants.\n",
+    //       s.machines.size(), invariants.size());
+}
+
+// Search breadth-first for Model::run, adding what's found to `res` (and the
+// terminating states to `terminating`, which keeps them for it)
+static void breadth_first(Model& model, Result& res, Terminals& terminating,
+                          int max_depth, bool exclude_symmetries, bool print) {
+    std::vector<SystemState>& pending = model.pending;
+    int depth = 0;
+    size_t nodes_seen = 0;
+    bool canonical = exclude_symmetries && !model.symmetries.empty();
+    model.visited.symmetries = canonical ? &model.symmetries : nullptr;
+    for (SystemState& s : pending) {
+        s.bucket(exclude_symmetries && !canonical && !model.fifo);
+    }
+
+    while ((max_depth < 0 || depth <= max_depth) && !pending.empty()
+           && !cancelled(model, res)) {
+        if (print) {
+            printf("Depth searched: %d\n    Total nodes explored: %lu\n"
+                   "    Unique nodes visited: %lu\n    Frontier size: %lu\n",
+                   depth, nodes_seen, model.visited.size(), pending.size());
+            printf("    Sample queue length: %lu\n", pending[0].messages.size());
+            printf("    Terminating states found: %lu\n", terminating.size());
+        }
+
+        // Violating states are kept out of the next layer
+        size_t kept = 0;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            const SystemState& s = pending[i];
+            ++nodes_seen;
+
+            // Note that we only care about the states we've visited, not how we
+            // got there; since this is a BFS, the history should always be the
+            // most minimal possible
+            model.visited.visit(s);
+
+            // Ensure that `s` validates against all invariants
+            if (const Predicate* p = violated(model.invariants, s,
+                                              last_step(s))) {
+                if (report(model, res, p, s)) break;
+                continue;
+            }
+            if (kept != i) pending[kept] = s;
+            ++kept;
+        }
+        if (res.stopped) {
+            ++depth;
+            break;
+        }
+        pending.erase(pending.begin() + kept, pending.end());
+        // Symmetric states are only excluded within a layer, besides those
+        // the visited set identifies (if canonicalizing)
+        Reached reached;
+        if (model.profiling) {
+            pending = get_all_neighbors<true>(pending, exclude_symmetries,
+                                              terminating, model.visited,
+                                              reached, model);
+        } else {
+            pending = get_all_neighbors<false>(pending, exclude_symmetries,
+                                               terminating, model.visited,
+                                               reached, model);
+        }
+        ++depth;
+    }
+    printf("Terminating depth: %d\n", depth - 1);
+    printf("Total nodes explored: %lu\n", nodes_seen);
+    if (model.profiling) model.profile.print();
+    res.explored += nodes_seen;
+    res.depth = std::max(res.depth, depth - 1);
+}
+
+Result Model::run(int max_depth, bool exclude_symmetries, bool print) {
+    Result res;
+    Terminals terminating{*this, res};
+    breadth_first(*this, res, terminating, max_depth, exclude_symmetries,
+                  print);
+    return res;
+}
+
+Result Model::run_delay_bounded(int max_delay, int max_depth,
+                                bool exclude_symmetries, bool print) {
+    std::vector<SystemState> initial = pending;
+    Result res;
+    // States terminating under more than one bound are only counted once
+    Terminals terminating{*this, res};
+    for (int k = 0; k <= max_delay && !cancelled(*this, res); ++k) {
+        if (print) printf("Delay bound: %d\n", k);
+        // Each bound starts over, since states pruned under the last one may
+        // now be reachable
+        pending = initial;
+        visited.clear();
+        delay_bound = k;
+        breadth_first(*this, res, terminating, max_depth, exclude_symmetries,
+                      print);
+    }
+    delay_bound = -1;
+    return res;
+}
+
+// Workers of a distributed search send each other paths (as transitions from
+// the initial state) in frames of a length followed by that many transitions;
+// a frame with length LAYER_END ends a worker's successors for the layer. To
+// the coordinator, they send a Report at two points in each layer, and it
+// answers with one of the commands below. The second is followed by a frame
+// for each violating state: the invariant's index, then the path to it.
+static const uint32_t LAYER_END = ~(uint32_t) 0;
+enum Command { CMD_STOP, CMD_GO };
+
+struct Report {
+    size_t pending;
+    size_t visited;
+    size_t explored;
+    size_t terminating;
+    size_t violated;
+};
+
+// Write or read exactly `n` bytes over `fd`, exiting if it fails (which for a
+// worker means the coordinator has gone, or vice versa)
+static void write_all(int fd, const void* p, size_t n) {
+    for (size_t i = 0; i < n;) {
+        ssize_t r = write(fd, (const char*) p + i, n - i);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            perror("distributed search: write");
+            exit(1);
+        }
+        i += r;
+    }
+}
+
+static void read_all(int fd, void* p, size_t n) {
+    for (size_t i = 0; i < n;) {
+        ssize_t r = read(fd, (char*) p + i, n - i);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            fprintf(stderr, "distributed search: lost a peer\n");
+            exit(1);
+        }
+        i += r;
+    }
+}
+
+// Send `out[j]` to each peer over `peers[j]` (which are non-blocking) while
+// receiving theirs, until every peer has ended its layer, and return the
+// paths received. Unread bytes are kept in `in` for the next layer.
+static std::vector<std::vector<uint32_t>> exchange(
+        const std::vector<int>& peers, std::vector<std::string>& out,
+        std::vector<std::string>& in) {
+    std::vector<std::vector<uint32_t>> paths;
+    std::vector<size_t> sent(peers.size(), 0);
+    std::vector<bool> ended(peers.size(), false);
+    for (size_t j = 0; j < peers.size(); ++j) {
+        if (peers[j] < 0) {
+            ended[j] = true;
+            sent[j] = out[j].size();
+        } else {
+            flat_put(out[j], LAYER_END);
+        }
+    }
+    for (;;) {
+        std::vector<struct pollfd> fds;
+        std::vector<size_t> who;
+        for (size_t j = 0; j < peers.size(); ++j) {
+            short events = (sent[j] < out[j].size() ? POLLOUT : 0)
+                | (ended[j] ? 0 : POLLIN);
+            if (!events) continue;
+            fds.push_back(pollfd{peers[j], events, 0});
+            who.push_back(j);
+        }
+        if (fds.empty()) break;
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("distributed search: poll");
+            exit(1);
+        }
+        for (size_t f = 0; f < fds.size(); ++f) {
+            size_t j = who[f];
+            if (fds[f].revents & POLLOUT) {
+                ssize_t r = write(peers[j], out[j].data() + sent[j],
+                                  out[j].size() - sent[j]);
+                if (r > 0) sent[j] += r;
+            }
+            if (!(fds[f].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            char buf[1 << 16];
+            ssize_t r = read(peers[j], buf, sizeof buf);
+            if (r < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (r <= 0) {
+                fprintf(stderr, "distributed search: lost a peer\n");
+                exit(1);
+            }
+            in[j].append(buf, r);
+            // Take off every complete frame
+            size_t at = 0;
+            while (!ended[j] && in[j].size() - at >= sizeof(uint32_t)) {
+                uint32_t len;
+                memcpy(&len, &in[j][at], sizeof len);
+                if (len == LAYER_END) {
+                    ended[j] = true;
+                    at += sizeof len;
+                    break;
+                }
+                size_t bytes = (1 + (size_t) len) * sizeof(uint32_t);
+                if (in[j].size() - at < bytes) break;
+                std::vector<uint32_t> path(len);
+                memcpy(path.data(), &in[j][at + sizeof len], len * sizeof len);
+                paths.push_back(std::move(path));
+                at += bytes;
+            }
+            in[j].erase(0, at);
+        }
+    }
+    for (std::string& o : out) o.clear();
+    return paths;
+}
+
+// Rebuild a state (with its history) from the path of transitions to it
+static SystemState follow(Model& model, const SystemState& initial,
+                          const std::vector<uint32_t>& path) {
+    SystemState s = initial;
+    for (uint32_t k : path) {
+        Diff* d = new Diff();
+        SystemState t = successor<false>(model, s, k, d);
+        t.history.push_back(d);
+        s = t;
+    }
+    return s;
+}
+
+// The flat encoding of `s`, which states are shared out and told apart by
+static FlatState shared_key(const SystemState& s) {
+    FlatState f{s};
+    if (!f.ok) {
+        fprintf(stderr, "distributed search: a state has no flat encoding "
+                "(some machine or message type doesn't implement "
+                "sub_flatten)\n");
+        exit(1);
+    }
+    return f;
+}
+
+// Which of `workers` owns the state encoded as `f`
+static size_t owner(const FlatState& f, unsigned workers) {
+    return bytes_hash(f.buf.data(), f.buf.size()) % workers;
+}
+
+// One worker of run_distributed: search the states this worker owns, layer by
+// layer, in step with the rest as directed by the coordinator over `control`.
+// States are received as paths and replayed, which costs a step per
+// transition of their depth, since states can't be rebuilt from their flat
+// encodings; deduping them within the layer first keeps that to one replay
+// for each distinct state sent.
+static void distributed_worker(Model& model, unsigned me, unsigned workers,
+                               int control, const std::vector<int>& peers) {
+    // Start over from the initial state, whatever searches ran before (and
+    // without symmetry)
+    const SystemState& initial = model.initial;
+    std::vector<std::vector<uint32_t>> paths;
+    model.pending.clear();
+    model.visited.clear();
+    model.visited.flat = true;
+    model.visited.symmetries = nullptr;
+    if (owner(shared_key(initial), workers) == me) {
+        paths.emplace_back();
+        model.pending.push_back(initial);
+    }
+    Result res;
+    Terminals terminating{model, res};
+    std::vector<std::string> out(workers), in(workers);
+    bool bounded = model.delay_bound >= 0;
+    size_t explored = 0;
+
+    for (;;) {
+        Report r{model.pending.size(), model.visited.size(), explored,
+                 terminating.size(), 0};
+        write_all(control, &r, sizeof r);
+        Command cmd;
+        read_all(control, &cmd, sizeof cmd);
+        if (cmd != CMD_GO) break;
+
+        // Violating states go to the coordinator to report, and aren't
+        // expanded
+        std::string found;
+        size_t kept = 0;
+        for (size_t i = 0; i < model.pending.size(); ++i) {
+            const SystemState& s = model.pending[i];
+            ++explored;
+            model.visited.visit(s);
+            if (const Predicate* p = violated(model.invariants, s,
+                                              last_step(s))) {
+                flat_put(found, (uint32_t) (p - model.invariants.data()));
+                flat_put(found, (uint32_t) paths[i].size());
+                found.append((const char*) paths[i].data(),
+                             paths[i].size() * sizeof(uint32_t));
+                ++r.violated;
+                continue;
+            }
+            if (kept != i) {
+                model.pending[kept] = s;
+                paths[kept] = std::move(paths[i]);
+            }
+            ++kept;
+        }
+        model.pending.erase(model.pending.begin() + kept, model.pending.end());
+        paths.resize(kept);
+        write_all(control, &r, sizeof r);
+        write_all(control, found.data(), found.size());
+        read_all(control, &cmd, sizeof cmd);
+        if (cmd != CMD_GO) break;
+
+        Reached reached;
+        std::vector<std::pair<size_t, size_t>> how;
+        std::vector<SystemState> next = get_all_neighbors<false>(
+            model.pending, false, terminating, model.visited, reached, model,
+            &how);
+
+        // Keep our own successors, and batch the rest up by owner. Each is
+        // only kept or sent the first time this layer reaches it, going by
+        // `reached.canonical` (without symmetries, a state's flat encoding is
+        // its canonical one), and likewise for those received.
+        std::vector<SystemState> mine;
+        std::vector<std::vector<uint32_t>> mine_paths;
+        for (size_t i = 0; i < next.size(); ++i) {
+            FlatState f = shared_key(next[i]);
+            size_t o = owner(f, workers);
+            if (!Reached::add(reached.canonical, std::move(f.buf),
+                              next[i].delay, bounded)) {
+                continue;
+            }
+            std::vector<uint32_t> path = paths[how[i].first];
+            path.push_back(how[i].second);
+            if (o == me) {
+                mine.push_back(next[i]);
+                mine_paths.push_back(std::move(path));
+            } else {
+                flat_put(out[o], (uint32_t) path.size());
+                out[o].append((const char*) path.data(),
+                              path.size() * sizeof(uint32_t));
+            }
+        }
+        next.clear();
+
+        // Rebuild the states sent to us by replaying their paths
+        for (std::vector<uint32_t>& path : exchange(peers, out, in)) {
+            SystemState s = follow(model, initial, path);
+            FlatState f = shared_key(s);
+            if (model.visited.seen(f, s.delay, bounded)
+                || !Reached::add(reached.canonical, std::move(f.buf), s.delay,
+                                 bounded)) {
+                continue;
+            }
+            mine.push_back(s);
+            mine_paths.push_back(std::move(path));
+        }
+        model.pending = std::move(mine);
+        paths = std::move(mine_paths);
+    }
+    fflush(stdout);
+}
+
+Result Model::run_distributed(unsigned workers, int max_depth, bool print) {
+    if (!workers) workers = std::max(1u, std::thread::hardware_concurrency());
+    // Fail here, rather than in every worker, if states have no flat encoding
+    // to be shared out by
+    shared_key(initial);
+    // Connect every pair of workers, and each to the coordinator
+    std::vector<std::vector<int>> mesh(workers, std::vector<int>(workers, -1));
+    std::vector<int> control(workers);
+    for (unsigned i = 0; i < workers; ++i) {
+        for (unsigned j = i + 1; j < workers; ++j) {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+                perror("distributed search: socketpair");
+                exit(1);
+            }
+            mesh[i][j] = sv[0];
+            mesh[j][i] = sv[1];
+        }
+    }
+    // Anything buffered would otherwise be printed by every worker too
+    fflush(stdout);
+    std::vector<pid_t> pids;
+    for (unsigned i = 0; i < workers; ++i) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+            perror("distributed search: socketpair");
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("distributed search: fork");
+            exit(1);
+        }
+        if (!pid) {
+            close(sv[0]);
+            for (unsigned a = 0; a < workers; ++a) {
+                for (unsigned b = 0; b < workers; ++b) {
+                    if (a != i && mesh[a][b] >= 0) close(mesh[a][b]);
+                }
+            }
+            for (int fd : mesh[i]) {
+                if (fd >= 0) fcntl(fd, F_SETFL, O_NONBLOCK);
+            }
+            distributed_worker(*this, i, workers, sv[1], mesh[i]);
+            _exit(0);
+        }
+        close(sv[1]);
+        control[i] = sv[0];
+        pids.push_back(pid);
+    }
+    for (std::vector<int>& row : mesh) {
+        for (int fd : row) {
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    // Sum up the workers' reports, replaying and reporting (in worker order)
+    // the violations they found, and tell them all `cmd`
+    Result res;
+    auto gather = [&] () {
+        Report total{0, 0, 0, 0, 0};
+        for (unsigned i = 0; i < workers; ++i) {
+            Report r;
+            read_all(control[i], &r, sizeof r);
+            total.pending += r.pending;
+            total.visited += r.visited;
+            total.explored += r.explored;
+            total.terminating += r.terminating;
+            total.violated += r.violated;
+            for (size_t j = 0; j < r.violated; ++j) {
+                uint32_t p, len;
+                read_all(control[i], &p, sizeof p);
+                read_all(control[i], &len, sizeof len);
+                std::vector<uint32_t> path(len);
+                read_all(control[i], path.data(), len * sizeof len);
+                if (res.stopped) continue;
+                report(*this, res, &invariants[p],
+                       follow(*this, initial, path));
+            }
+        }
+        return total;
+    };
+    auto command = [&] (Command cmd) {
+        for (unsigned i = 0; i < workers; ++i) {
+            write_all(control[i], &cmd, sizeof cmd);
+        }
+    };
+
+    int depth = 0;
+    Report total;
+    for (;;) {
+        total = gather();
+        if ((max_depth >= 0 && depth > max_depth) || !total.pending
+            || cancelled(*this, res)) {
+            command(CMD_STOP);
+            break;
+        }
+        if (print) {
+            printf("Depth searched: %d\n    Total nodes explored: %lu\n"
+                   "    Unique nodes visited: %lu\n    Frontier size: %lu\n"
+                   "    Terminating states found: %lu\n", depth,
+                   total.explored, total.visited, total.pending,
+                   total.terminating);
+            fflush(stdout);
+        }
+        command(CMD_GO);
+
+        Report checked = gather();
+        total.explored = checked.explored;
+        if (res.stopped) {
+            command(CMD_STOP);
+            ++depth;
+            break;
+        }
+        command(CMD_GO);
+        ++depth;
+    }
+    for (unsigned i = 0; i < workers; ++i) {
+        waitpid(pids[i], nullptr, 0);
+        close(control[i]);
+    }
+    printf("Terminating depth: %d\n", depth - 1);
+    printf("Total nodes explored: %lu\n", total.explored);
+    res.terminated = total.terminating;
+    res.explored = total.explored;
+    res.depth = depth - 1;
+    return res;
+}
+
+struct Scored {
+    // A state queued for best-first search; higher priorities are expanded
+    // first, and ties in the order they were queued
+    long priority;
+    size_t order;
+    SystemState state;
+
+    bool operator<(const Scored& rhs) const {
+        if (priority != rhs.priority) return priority < rhs.priority;
+        return order > rhs.order;
+    }
+};
+
+Result Model::run_guided(
+        std::function<long(const SystemState&)> score, long depth_weight,
+        int max_depth, bool exclude_symmetries, bool print) {
+    Result res;
+    Terminals terminating{*this, res};
+    // Unlike breadth-first search, symmetric states are excluded globally,
+    // since there are no layers
+    Reached reached;
+    std::priority_queue<Scored> queue;
+    size_t order = 0;
+    size_t nodes_seen = 0;
+    int deepest = 0;
+    long best = 0;
+
+    auto push = [&] (const SystemState& s) {
+        queue.push(Scored{score(s) - depth_weight * s.depth, order++, s});
+    };
+    bool canonical = exclude_symmetries && !symmetries.empty();
+    visited.symmetries = canonical ? &symmetries : nullptr;
+    for (SystemState& s : pending) {
+        s.bucket(exclude_symmetries && !canonical && !fifo);
+        push(s);
+    }
+    pending.clear();
+
+    while (!queue.empty() && !cancelled(*this, res)) {
+        // The queue only gives out const references, so copy the top out
+        SystemState s{queue.top().state};
+        queue.pop();
+        // A state may have been queued more than once before being expanded
+        if (visited.seen(s, delay_bound >= 0)) continue;
+        ++nodes_seen;
+        visited.visit(s);
+        if (s.depth > deepest) deepest = s.depth;
+
+        // Violating states aren't expanded
+        if (const Predicate* p = violated(invariants, s, last_step(s))) {
+            report(*this, res, p, s);
+            continue;
+        }
+
+        long sc = score(s);
+        if (print && (nodes_seen == 1 || sc > best)) {
+            printf("Best score: %ld at depth %d\n"
+                   "    Total nodes explored: %lu\n    Queue size: %lu\n"
+                   "    Terminating states found: %lu\n",
+                   sc, s.depth, nodes_seen, queue.size(), terminating.size());
+        }
+        if (nodes_seen == 1 || sc > best) best = sc;
+
+        if (max_depth >= 0 && s.depth >= max_depth) continue;
+        std::vector<SystemState> node{s};
+        std::vector<SystemState> next;
+        if (profiling) {
+            next = get_all_neighbors<true>(node, exclude_symmetries,
+                                           terminating, visited, reached,
+                                           *this);
+        } else {
+            next = get_all_neighbors<false>(node, exclude_symmetries,
+                                            terminating, visited, reached,
+                                            *this);
+        }
+        for (const SystemState& n : next) push(n);
+    }
+    printf("Terminating depth: %d\n", deepest);
+    printf("Total nodes explored: %lu\n", nodes_seen);
+    if (profiling) profile.print();
+    res.explored = nodes_seen;
+    res.depth = deepest;
+    return res;
+}
+
+// Reconstruct the full history of the state on top of a search path, given the
+// root it started from (any frame type with `state` and `diff` will do)
+template <typename F>
+static SystemState path_trace(const SystemState& root, std::vector<F>& stack) {
+    SystemState trace{stack.back().state};
+    trace.history = root.history;
+    for (Diff*& d : trace.history) d->ref_inc();
+    for (F& f : stack) {
+        if (!f.diff) continue;
+        trace.history.push_back(f.diff);
+        f.diff->ref_inc();
+    }
+    return trace;
+}
+
+struct Frame {
+    // One entry of the depth-first search path. States on the path do not
+    // carry their own history (that would make the stack quadratic in depth);
+    // instead, each frame keeps the diff that led to it.
+    SystemState state;
+    Diff* diff;
+    // The next transition to try (numbered as for `transitions`)
+    size_t next;
+
+    Frame(const SystemState& s, Diff* d) : state(s), diff(d), next(0) {}
+};
+
+// Hashes a flat encoding's buffer, to key unordered containers by
+struct FlatHash {
+    size_t operator()(const std::string& buf) const {
+        return bytes_hash(buf.data(), buf.size());
+    }
+};
+
+Result Model::run_dfs(int max_depth, size_t cache_size, bool print) {
+    Result res;
+    // Terminating states found under every limit, so each is only counted
+    // once
+    Terminals terminating{*this, res};
+    std::vector<Frame> stack;
+    // A bounded cache of the flat encodings of visited states (those without
+    // one aren't cached), mapped to the shallowest depth at which they were
+    // seen; evicted in insertion order once full. Keeping the bytes rather
+    // than the states means evicted machines and messages are freed.
+    std::unordered_map<std::string, int, FlatHash> cache;
+    std::queue<const std::string*> order;
+    size_t nodes_seen = 0;
+    int limit;
+
+    for (limit = 0; (max_depth < 0 || limit <= max_depth)
+                    && !cancelled(*this, res); ++limit) {
+        // Whether any state was cut off by the depth limit; if none were, the
+        // whole state space has been explored and deepening further is moot
+        bool cut = false;
+        cache.clear();
+        order = {};
+
+        for (const SystemState& root : pending) {
+            stack.emplace_back(root, nullptr);
+            stack.back().state.depth = 0;
+            ++nodes_seen;
+
+            while (!stack.empty()) {
+                Frame& f = stack.back();
+                int depth = stack.size() - 1;
+
+                // Check states as they're first entered; violating ones are
+                // leaves
+                if (!f.next) {
+                    if (cancelled(*this, res)) break;
+                    const Predicate* p = violated(invariants, f.state, f.diff);
+                    if (p) {
+                        report(*this, res, p, path_trace(root, stack));
+                        if (f.diff) f.diff->ref_dec();
+                        stack.pop_back();
+                        continue;
+                    }
+                    if (f.state.terminated()) terminating.add(f.state);
+                }
+
+                size_t k = f.next;
+                if (depth == limit || k >= transitions(f.state)) {
+                    if (depth == limit && !f.state.terminated()) cut = true;
+                    if (f.diff) f.diff->ref_dec();
+                    stack.pop_back();
+                    continue;
+                }
+                ++f.next;
+                if (!enabled(*this, f.state, k)) continue;
+
+                // The diff keeps any message taken alive while it's on the
+                // path
+                Diff* d = new Diff();
+                SystemState next = profiling
+                    ? successor<true>(*this, f.state, k, d)
+                    : successor<false>(*this, f.state, k, d);
+                if (stutters(f.state, next, d)) {
+                    d->ref_dec();
+                    continue;
+                }
+
+                FlatState key;
+                if (cache_size) key = FlatState{next};
+                if (key.ok) {
+                    auto [it, added] = cache.try_emplace(std::move(key.buf),
+                                                         next.depth);
+                    if (!added && it->second <= next.depth) {
+                        d->ref_dec();
+                        continue;
+                    }
+                    if (added) {
+                        order.push(&it->first);
+                        if (cache.size() > cache_size) {
+                            cache.erase(cache.find(*order.front()));
+                            order.pop();
+                        }
+                    } else {
+                        it->second = next.depth;
+                    }
+                }
+                ++nodes_seen;
+                stack.emplace_back(next, d);
+            }
+            if (res.stopped) break;
+        }
+        for (Frame& f : stack) {
+            if (f.diff) f.diff->ref_dec();
+        }
+        stack.clear();
+
+        if (print) {
+            printf("Depth bound: %d\n    Total nodes explored: %lu\n"
+                   "    Cached states: %lu\n"
+                   "    Terminating states found: %lu\n",
+                   limit, nodes_seen, cache.size(), terminating.size());
+        }
+        if (!cut || res.stopped) break;
+    }
+    if (max_depth >= 0 && limit > max_depth) limit = max_depth;
+    printf("Terminating depth: %d\n", limit);
+    printf("Total nodes explored: %lu\n", nodes_seen);
+    if (profiling) profile.print();
+    res.explored = nodes_seen;
+    res.depth = limit;
+    return res;
+}
+
+struct DporFrame {
+    // One entry of the DPOR search path; like Frame, but the transitions
+    // to try are chosen per message by race detection instead of exhaustively
+    SystemState state;
+    Diff* diff;
+    // Vector clock (indexed by machine) of the delivery that led here, where
+    // each component is the path index of the latest delivery to that machine
+    // which happens-before it; empty for drops and the root
+    std::vector<size_t> clock;
+    // Path index of the latest delivery to each machine, up to this state
+    std::vector<size_t> last;
+    // Messages whose delivery (and drop) must be explored from this state, and
+    // those which already have been
+    std::set<Message*> backtrack;
+    std::set<Message*> done;
+    // The message currently being explored, and whether its drop still is
+    Message* cur;
+    bool drop_next;
+    bool entered;
+
+    DporFrame(const SystemState& s, Diff* d)
+        : state(s), diff(d), cur(nullptr), drop_next(false), entered(false) {}
+};
+
+// Deliver `a` then `b` to a copy of `m`, returning the final machine, or
+// nullptr if either delivery sends anything
+static Machine* deliver_both(Machine* m, Message* a, Message* b) {
+    Machine* c = m->copy();
+    for (Message* msg : {a, b}) {
+        std::vector<Message*> out = c->handle_message(msg);
+        if (!out.empty()) {
+            for (Message* o : out) o->ref_dec();
+            c->ref_dec();
+            return nullptr;
+        }
+    }
+    return c;
+}
+
+// Whether `a` and `b` are independent deliveries to `m`: in either order they
+// send nothing and leave it in the same state. Deliveries which send messages
+// are never considered independent, since reordering them would also reorder
+// the happens-before relation of everything they send.
+static bool commute(Machine* m, Message* a, Message* b) {
+    Machine* ab = deliver_both(m, a, b);
+    if (!ab) return false;
+    Machine* ba = deliver_both(m, b, a);
+    bool same = ba && !ab->compare(ba);
+    ab->ref_dec();
+    if (ba) ba->ref_dec();
+    return same;
+}
+
+// Whether `m` is pending in `s` and may be taken there
+static bool deliverable_in(const SystemState& s, Message* m, bool fifo) {
+    for (size_t i = 0; i < s.messages.size(); ++i) {
+        if (s.messages[i] == m) return s.deliverable(i, fifo);
+    }
+    return false;
+}
+
+// Whether `a` must be taken before `b` because they share a fifo channel
+static bool same_channel(Message* a, Message* b, bool fifo) {
+    return (fifo || (a->fifo && b->fifo)) && a->src == b->src
+        && a->dst == b->dst;
+}
+
+Result Model::run_dpor(int max_depth, bool print) {
+    Result res;
+    std::vector<DporFrame> stack;
+    // Path index of the delivery that sent each in-flight message (0 for
+    // messages sent on startup)
+    std::unordered_map<Message*, size_t> sent_by;
+    Terminals terminating{*this, res};
+    size_t nodes_seen = 0;
+    size_t races = 0;
+    int deepest = 0;
+    // Pop the top frame, forgetting what its transition sent (the messages
+    // are freed with it, so their addresses may be reused)
+    auto pop = [&] () {
+        DporFrame& f = stack.back();
+        if (f.diff) {
+            for (Message* m : f.diff->sent) sent_by.erase(m);
+            f.diff->ref_dec();
+        }
+        stack.pop_back();
+    };
+
+    for (const SystemState& root : pending) {
+        size_t machines = root.machines.size();
+        stack.emplace_back(root, nullptr);
+        stack.back().state.depth = 0;
+        stack.back().last.assign(machines, 0);
+        ++nodes_seen;
+
+        while (!stack.empty()) {
+            size_t n = stack.size() - 1;
+            DporFrame& f = stack.back();
+
+            if (!f.entered) {
+                f.entered = true;
+                if ((int) n > deepest) deepest = n;
+                if (cancelled(*this, res)) break;
+                // Violating states are leaves, but their races still count
+                const Predicate* p = violated(invariants, f.state, f.diff);
+                if (p) {
+                    report(*this, res, p, path_trace(root, stack));
+                } else if (f.state.terminated()) {
+                    terminating.add(f.state);
+                }
+
+                // Race detection: each pending message races with the last
+                // delivery to the same machine, unless that delivery happened
+                // before the message was sent. If the two are independent,
+                // there is no race with it, but there may be with the one
+                // before.
+                // Messages stuck behind others on a fifo channel can't race
+                // yet, and those ahead of them on it always come first.
+                for (size_t j = 0; j < f.state.messages.size(); ++j) {
+                    if (!f.state.deliverable(j, fifo)) continue;
+                    Message* m = f.state.messages[j];
+                    auto it = sent_by.find(m);
+                    size_t k = it == sent_by.end() ? 0 : it->second;
+                    auto before = [&] (size_t i) {
+                        return (k && stack[k].clock[m->dst] >= i)
+                            || same_channel(stack[i].diff->delivered, m, fifo);
+                    };
+                    size_t i = f.last[m->dst];
+                    while (i && !before(i)
+                           && commute(stack[i - 1].state.machines[m->dst],
+                                      stack[i].diff->delivered, m)) {
+                        i = stack[i - 1].last[m->dst];
+                    }
+                    if (!i || before(i)) continue;
+                    DporFrame& pre = stack[i - 1];
+                    ++races;
+                    if (deliverable_in(pre.state, m, fifo)) {
+                        pre.backtrack.insert(m);
+                    } else {
+                        // The message was sent later, by some chain of events
+                        // independent of delivery i; conservatively try
+                        // everything that could be taken instead
+                        for (size_t q = 0; q < pre.state.messages.size(); ++q) {
+                            if (pre.state.deliverable(q, fifo)) {
+                                pre.backtrack.insert(pre.state.messages[q]);
+                            }
+                        }
+                    }
+                }
+
+                if (p || (int) n == max_depth || f.state.messages.empty()) {
+                    pop();
+                    continue;
+                }
+                f.backtrack.insert(f.state.messages.front());
+            }
+
+            bool drop = f.drop_next;
+            if (drop) {
+                f.drop_next = false;
+            } else {
+                f.cur = nullptr;
+                for (Message* m : f.backtrack) {
+                    if (!in_set(f.done, m)) {
+                        f.cur = m;
+                        break;
+                    }
+                }
+                if (!f.cur) {
+                    // All done here
+                    pop();
+                    continue;
+                }
+                f.done.insert(f.cur);
+                f.drop_next = f.cur->may_drop
+                    && within(max_drops, f.state.drops);
+            }
+
+            Message* msg = f.cur;
+            size_t i = 0;
+            while (f.state.messages[i] != msg) ++i;
+            size_t k = 3 * i + (drop ? DROP : DELIVER);
+            Diff* d = new Diff();
+            SystemState next = profiling
+                ? successor<true>(*this, f.state, k, d)
+                : successor<false>(*this, f.state, k, d);
+            std::vector<size_t> clock;
+            std::vector<size_t> last = f.last;
+            if (!drop) {
+                // The delivery happens after the previous one to the same
+                // machine, and after the delivery which sent the message
+                id_t p = msg->dst;
+                clock.assign(machines, 0);
+                if (size_t j = f.last[p]) clock = stack[j].clock;
+                auto it = sent_by.find(msg);
+                if (it != sent_by.end() && it->second) {
+                    std::vector<size_t>& c = stack[it->second].clock;
+                    for (size_t q = 0; q < machines; ++q) {
+                        clock[q] = std::max(clock[q], c[q]);
+                    }
+                }
+                clock[p] = n + 1;
+                last[p] = n + 1;
+                for (Message* m : d->sent) sent_by[m] = n + 1;
+            }
+
+            ++nodes_seen;
+            // Careful: this invalidates `f`
+            stack.emplace_back(next, d);
+            stack.back().clock = std::move(clock);
+            stack.back().last = std::move(last);
+        }
+        if (res.stopped) break;
+    }
+    while (!stack.empty()) pop();
+
+    if (print) {
+        printf("Races found: %lu\n    Terminating states found: %lu\n",
+               races, terminating.size());
+    }
+    printf("Terminating depth: %d\n", deepest);
+    printf("Total nodes explored: %lu\n", nodes_seen);
+    if (profiling) profile.print();
+    res.explored = nodes_seen;
+    res.depth = deepest;
+    return res;
+}
+
+struct WalkState {
+    // A random walk's state: a SystemState's machines, messages and fault
+    // counts, but in plain vectors which are reused from step to step (so
+    // they don't reallocate once warmed up), and as raw pointers, since the
+    // initial machines and messages are shared between threads and so are
+    // never reference counted here
+    std::vector<Machine*> machines;
+    std::vector<Message*> messages;
+    int depth;
+    int drops;
+    int dups;
+    int crashes;
+    // A copy as a SystemState (with an uncounted message list), only made for
+    // invariants over whole states
+    mutable SystemState copy;
+
+    WalkState()
+        : depth(0), drops(0), dups(0), crashes(0),
+          copy(std::vector<Machine*>{}) {
+        copy.messages = MessageList{false};
+    }
+    ~WalkState() {
+        // Don't let the copy release what it never owned
+        copy.machines.clear();
+    }
+
+    bool terminated() const {
+        return SystemState::terminated(messages, machines);
+    }
+};
+
+static const SystemState& whole(const WalkState& s) {
+    s.copy.machines.assign(s.machines.begin(), s.machines.end());
+    s.copy.messages.clear();
+    for (Message* m : s.messages) s.copy.messages.push_back(m);
+    s.copy.depth = s.depth;
+    s.copy.drops = s.drops;
+    s.copy.dups = s.dups;
+    s.copy.crashes = s.crashes;
+    return s.copy;
+}
+
+struct Walker {
+    // Per-thread state for random walks, kept in `view`. Anything created
+    // during a walk is instead recorded, and released on restart: a machine
+    // is copied into `copies` the first time the walk acts on it, and then
+    // acted on in place, and every message sent goes in `owned`.
+    const SystemState& initial;
+    WalkState view;
+    std::vector<Machine*> copies;
+    std::vector<bool> copied;
+    std::vector<Message*> owned;
+    // What the current step sent, reused between steps
+    std::vector<Message*> sent;
+    // The transitions which can be taken at the current step
+    std::vector<size_t> choices;
+    std::mt19937_64 rng;
+    // The transition taken at each step (if recording), the message or
+    // machine (and timer) it acted on, and how many messages were owned
+    // before it
+    struct Step {
+        Action action;
+        Message* msg;
+        id_t machine;
+        int timer;
+        size_t owned;
+    };
+    std::vector<Step> steps;
+    // If set, every state walked into is added to it, to count the distinct
+    // states the walks have covered between them; each is encoded in `key`
+    StateTable* cover;
+    FlatState key;
+
+    Walker(const SystemState& s, StateTable* cover = nullptr)
+        : initial(s), cover(cover) {}
+
+    ~Walker() {
+        reset();
+    }
+
+    void reset() {
+        for (Message*& m : owned) m->ref_dec();
+        owned.clear();
+        for (Machine*& m : copies) m->ref_dec();
+        copies.clear();
+        copied.assign(initial.machines.size(), false);
+        steps.clear();
+        view.machines.assign(initial.machines.begin(), initial.machines.end());
+        view.messages.assign(initial.messages.begin(), initial.messages.end());
+        view.depth = 0;
+        view.drops = view.dups = view.crashes = 0;
+    }
+
+    // Machine `j` of the view, to act on: replaced with a copy of its own the
+    // first time in a walk
+    Machine* own(id_t j) {
+        if (copied[j]) return view.machines[j];
+        Machine* target = view.machines[j]->copy();
+        copies.push_back(target);
+        copied[j] = true;
+        view.machines[j] = target;
+        return target;
+    }
+
+    // Walk from the initial state for at most `length` steps (or until it
+    // terminates), choosing uniformly among the transitions `model`
+    // allows with `seed`. Returns the invariant violated, if any.
+    const Predicate* walk(unsigned long seed, int length, const Model& model,
+                          bool record) {
+        reset();
+        rng.seed(seed);
+        while (view.depth < length && !view.terminated()) {
+            // Only the armed timers are worth checking, so skip the rest
+            choices.clear();
+            size_t n = 3 * view.messages.size();
+            for (size_t k = 0; k < n; ++k) {
+                if (enabled(model, view, k)) choices.push_back(k);
+            }
+            for (size_t j = 0; j < view.machines.size(); ++j) {
+                size_t k = n + j * (1 + MAX_TIMERS);
+                if (enabled(model, view, k)) choices.push_back(k);
+                for (unsigned t = view.machines[j]->timers; t; t &= t - 1) {
+                    choices.push_back(k + 1 + __builtin_ctz(t));
+                }
+            }
+            size_t k = choices[rng() % choices.size()];
+            if (const Predicate* p = take(k, model, record)) return p;
+        }
+        return nullptr;
+    }
+
+    // Replay `path` from the initial state instead, matching each step's
+    // message by value (so the path may come from elsewhere, with steps left
+    // out), until it violates an invariant, which is returned. A step which
+    // can't be taken is skipped, and with it (as their messages never turn
+    // up) the deliveries of whatever it would have sent. `kept` is set to the
+    // steps taken, up to the violation.
+    const Predicate* follow(const std::vector<Step>& path, const Model& model,
+                            std::vector<Step>& kept, bool record) {
+        reset();
+        kept.clear();
+        for (const Step& st : path) {
+            long k = find(st, model);
+            if (k < 0) continue;
+            kept.push_back(st);
+            if (const Predicate* p = take(k, model, record)) return p;
+        }
+        return nullptr;
+    }
+
+    // The transition from the view which takes `st`, or -1 if none can
+    long find(const Step& st, const Model& model) const {
+        size_t n = 3 * view.messages.size();
+        if (st.action == RESTART || st.action == FIRE) {
+            size_t k = n + st.machine * (1 + MAX_TIMERS)
+                + (st.action == FIRE ? 1 + st.timer : 0);
+            return enabled(model, view, k) ? (long) k : -1;
+        }
+        size_t i = 0;
+        for (Message* m : view.messages) {
+            size_t k = 3 * i++ + st.action;
+            if (!m->compare(st.msg) && enabled(model, view, k)) return k;
+        }
+        return -1;
+    }
+
+    // Take transition `k` from the view, returning the invariant this
+    // violates, if any
+    const Predicate* take(size_t k, const Model& model, bool record) {
+        Action a = action(view, k);
+        bool machine = a == RESTART || a == FIRE;
+        if (record) {
+            Message* msg = machine ? nullptr : view.messages[k / 3];
+            id_t j = machine ? machine_of(view, k) : 0;
+            int t = a == FIRE ? timer_of(view, k) : 0;
+            steps.push_back(Step{a, msg, j, t, owned.size()});
+        }
+        sent.clear();
+        // The machine acted on, if any
+        long changed = machine ? (long) machine_of(view, k) : -1;
+        if (a == RESTART) {
+            Machine* target = own(machine_of(view, k));
+            target->timers = 0;
+            sent = target->on_restart();
+            if (model.max_crashes >= 0) ++view.crashes;
+        } else if (a == FIRE) {
+            Machine* target = own(machine_of(view, k));
+            int t = timer_of(view, k);
+            target->cancel(t);
+            sent = target->on_timer(t);
+        } else if (a == DUPLICATE) {
+            // The copy is the same (immutable) message, queued again
+            view.messages.push_back(view.messages[k / 3]);
+            if (model.max_dups >= 0) ++view.dups;
+        } else {
+            Message* msg = view.messages[k / 3];
+            // Messages are kept in the order they were sent, for fifo
+            view.messages.erase(view.messages.begin() + k / 3);
+            if (a == DROP) {
+                if (model.max_drops >= 0) ++view.drops;
+            } else {
+                sent = own(msg->dst)->handle_message(msg);
+                changed = msg->dst;
+            }
+        }
+        for (Message*& m : sent) {
+            owned.push_back(m);
+            view.messages.push_back(m);
+        }
+        ++view.depth;
+        if (cover) {
+            flatten_state(key, view, std::vector<id_t>{});
+            if (key.ok) cover->insert(key, 0);
+        }
+        return violated(model.invariants, view, changed, sent);
+    }
+    // Rebuild the last (recorded) walk as a standalone state, with its
+    // history
+    SystemState trace() const {
+        SystemState s{std::vector<Machine*>{}};
+        for (Machine* m : view.machines) {
+            m->ref_inc();
+            s.machines.push_back(m);
+        }
+        for (Message* m : view.messages) s.send(m);
+        s.depth = view.depth;
+        s.drops = view.drops;
+        s.dups = view.dups;
+        s.crashes = view.crashes;
+        for (size_t k = 0; k < steps.size(); ++k) {
+            const Step& st = steps[k];
+            Diff* d = new Diff();
+            if (st.msg) st.msg->ref_inc();
+            if (st.action == DROP) {
+                d->dropped = st.msg;
+            } else if (st.action == DUPLICATE) {
+                d->duplicated = st.msg;
+            } else {
+                if (st.action == RESTART) {
+                    d->restarted = st.machine;
+                } else if (st.action == FIRE) {
+                    d->fired = st.machine;
+                    d->timer = st.timer;
+                } else {
+                    d->delivered = st.msg;
+                }
+                // The messages a delivery, restart or firing sent
+                size_t end = k + 1 < steps.size() ? steps[k + 1].owned
+                                                  : owned.size();
+                for (size_t j = st.owned; j < end; ++j) {
+                    Message* m = owned[j];
+                    m->ref_inc();
+                    d->sent.push_back(m);
+                }
+            }
+            s.history.push_back(d);
+        }
+        return s;
+    }
+};
+
+Result Model::simulate(size_t walks, int length, unsigned long seed,
+                       unsigned threads, bool print) {
+    if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+    Result res;
+    // Not `pending`, which other searches may have emptied
+    if (const Predicate* p = violated(invariants, initial)) {
+        report(*this, res, p, initial);
+        return res;
+    }
+
+    // Walks are handed out in chunks; walk `w` always uses seed `seed + w`, so
+    // it can be replayed on its own regardless of which thread ran it
+    const size_t chunk = 64;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> total_steps{0};
+    std::atomic<size_t> terminating{0};
+    std::atomic<int> deepest{0};
+    std::mutex lock;
+    // The seeds of the violating walks
+    std::vector<unsigned long> failed;
+
+    // With a flat visited set, the threads share it to count the distinct
+    // states walked through
+    StateTable* cover = visited.flat ? &visited.flats : nullptr;
+    if (cover) {
+        visited.clear();
+        FlatState f{initial};
+        if (f.ok) cover->insert(f, 0);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    auto worker = [&] () {
+        Walker w{initial, cover};
+        size_t steps = 0, terminal = 0;
+        int depth = 0;
+        while (!cancel.load(std::memory_order_relaxed)) {
+            size_t first = next.fetch_add(chunk, std::memory_order_relaxed);
+            if (first >= walks) break;
+            for (size_t i = first; i < std::min(first + chunk, walks)
+                     && !cancel.load(std::memory_order_relaxed); ++i) {
+                const Predicate* p = w.walk(seed + i, length, *this, false);
+                steps += w.view.depth;
+                depth = std::max(depth, w.view.depth);
+                if (w.view.terminated()) ++terminal;
+                if (p) {
+                    std::lock_guard<std::mutex> g{lock};
+                    failed.push_back(seed + i);
+                    if (max_violations && failed.size() >= max_violations) {
+                        cancel = true;
+                    }
+                }
+            }
+        }
+        total_steps += steps;
+        terminating += terminal;
+        int d = deepest.load();
+        while (d < depth && !deepest.compare_exchange_weak(d, depth)) {}
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; ++t) pool.emplace_back(worker);
+    for (std::thread& t : pool) t.join();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (print) {
+        printf("Walks simulated: %lu\n    Total steps: %lu\n"
+               "    Steps per second: %.0f\n    Threads: %u\n",
+               std::min(next.load(), walks), total_steps.load(),
+               total_steps / secs, threads);
+        if (cover) printf("    Distinct states: %lu\n", cover->size());
+    }
+    // Threads racing to the limit may find more than enough; keep the
+    // lowest seeds, and replay those walks (single-threaded now) to report
+    // them
+    std::sort(failed.begin(), failed.end());
+    if (max_violations && failed.size() > max_violations) {
+        failed.resize(max_violations);
+    }
+    for (unsigned long s : failed) {
+        Walker w{initial};
+        const Predicate* p = w.walk(s, length, *this, true);
+        SystemState trace = w.trace();
+        if (known(res, trace)) continue;
+        printf("Violating walk seed: %lu\n", s);
+        report(*this, res, p, trace);
+    }
+    res.terminated = terminating;
+    res.explored = total_steps;
+    res.depth = deepest;
+    return res;
+}
+
+struct MessageLess {
+    // Orders messages by value, so equal messages form one fairness class
+    bool operator()(Message* a, Message* b) const {
+        return a->compare(b) < 0;
+    }
+};
+
+struct LiveEdge {
+    // A transition within a component, between indices of its states, and the
+    // message it delivers (if it is a delivery) or the timer it fires (if it
+    // is a firing, as machine * MAX_TIMERS + timer; otherwise -1)
+    size_t from;
+    size_t to;
+    size_t k;
+    Message* msg;
+    long timer;
+};
+
+struct LiveNode {
+    // A state on the Tarjan stack of the liveness search, with its Tarjan
+    // bookkeeping and the transitions found from it to states on the stack
+    // (indexed by their position there), which are all that can be within
+    // its component
+    SystemState state;
+    size_t index;
+    size_t low;
+    std::vector<LiveEdge> edges;
+};
+
+struct LiveStore {
+    // The positions of the states on the Tarjan stack: by flat encoding, or
+    // whole for states without one. The states off the stack, whose
+    // components are done with, go in the model's visited set instead.
+    std::unordered_map<std::string, size_t, FlatHash> flats;
+    std::map<SystemState, size_t> states;
+
+    // The position of `s` (whose encoding is `key`), or -1 if it isn't there
+    long find(const SystemState& s, const FlatState& key) const {
+        if (key.ok) {
+            auto it = flats.find(key.buf);
+            return it == flats.end() ? -1 : (long) it->second;
+        }
+        auto it = states.find(s);
+        return it == states.end() ? -1 : (long) it->second;
+    }
+    void add(const SystemState& s, FlatState& key, size_t at) {
+        if (key.ok) flats.emplace(std::move(key.buf), at);
+        else states.emplace(s, at);
+    }
+    void remove(const SystemState& s) {
+        FlatState key{s};
+        if (key.ok) flats.erase(key.buf);
+        else states.erase(s);
+    }
+};
+
+struct LiveFrame {
+    // One entry of the liveness search's path, as Frame, with the position of
+    // its state on the Tarjan stack
+    SystemState state;
+    Diff* diff;
+    size_t next;
+    size_t node;
+
+    LiveFrame(const SystemState& s, Diff* d, size_t n)
+        : state(s), diff(d), next(0), node(n) {}
+};
+
+// Strongly connected components of the subgraph of `edges` on `nodes`
+static std::vector<std::vector<size_t>> components(
+        const std::vector<size_t>& nodes, const std::vector<LiveEdge>& edges,
+        size_t count) {
+    std::vector<std::vector<size_t>> adj(count);
+    std::vector<bool> in(count, false);
+    for (size_t n : nodes) in[n] = true;
+    for (const LiveEdge& e : edges) {
+        if (in[e.from] && in[e.to]) adj[e.from].push_back(e.to);
+    }
+    std::vector<std::vector<size_t>> ret;
+    std::vector<long> index(count, -1), low(count, 0);
+    std::vector<bool> on(count, false);
+    std::vector<size_t> stack;
+    long counter = 0;
+    for (size_t root : nodes) {
+        if (index[root] >= 0) continue;
+        // Iterative Tarjan: (node, next neighbor) pairs
+        std::vector<std::pair<size_t, size_t>> calls{{root, 0}};
+        index[root] = low[root] = counter++;
+        stack.push_back(root);
+        on[root] = true;
+        while (!calls.empty()) {
+            auto& [u, k] = calls.back();
+            if (k < adj[u].size()) {
+                size_t v = adj[u][k++];
+                if (index[v] < 0) {
+                    index[v] = low[v] = counter++;
+                    stack.push_back(v);
+                    on[v] = true;
+                    calls.emplace_back(v, 0);
+                } else if (on[v]) {
+                    low[u] = std::min(low[u], index[v]);
+                }
+                continue;
+            }
+            if (low[u] == index[u]) {
+                std::vector<size_t> comp;
+                size_t v;
+                do {
+                    v = stack.back();
+                    stack.pop_back();
+                    on[v] = false;
+                    comp.push_back(v);
+                } while (v != u);
+                ret.push_back(comp);
+            }
+            size_t done = u;
+            calls.pop_back();
+            if (!calls.empty()) {
+                size_t parent = calls.back().first;
+                low[parent] = std::min(low[parent], low[done]);
+            }
+        }
+    }
+    return ret;
+}
+
+// Find a fair cycle within `nodes` (a strongly connected set), where a cycle
+// is fair if every message pending somewhere on it is also delivered
+// somewhere on it, and likewise every timer armed somewhere on it fires. States
+// with a pending message that is never delivered (or an armed timer that never
+// fires) within the set can't be on a fair cycle, so they are removed and the
+// remaining components searched in turn. Returns the nodes of a strongly
+// connected set which contains a fair cycle through all its edges, or an
+// empty vector if there is none.
+static std::vector<size_t> fair_component(
+        std::vector<size_t> nodes, const std::vector<LiveEdge>& edges,
+        const std::vector<const SystemState*>& states) {
+    std::vector<bool> in(states.size(), false);
+    for (size_t n : nodes) in[n] = true;
+    bool cyclic = nodes.size() > 1;
+    std::set<Message*, MessageLess> delivered;
+    std::set<long> fired;
+    for (const LiveEdge& e : edges) {
+        if (!in[e.from] || !in[e.to]) continue;
+        if (e.from == e.to) cyclic = true;
+        if (e.msg) delivered.insert(e.msg);
+        if (e.timer >= 0) fired.insert(e.timer);
+    }
+    if (!cyclic) return std::vector<size_t>{};
+
+    std::vector<size_t> fair;
+    for (size_t n : nodes) {
+        bool ok = true;
+        for (Message* const& m : states[n]->messages) {
+            if (!in_set(delivered, m)) {
+                ok = false;
+                break;
+            }
+        }
+        for (size_t j = 0; ok && j < states[n]->machines.size(); ++j) {
+            for (int t = 0; t < MAX_TIMERS; ++t) {
+                if (states[n]->machines[j]->armed(t)
+                    && !in_set(fired, (long) j * MAX_TIMERS + t)) {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        if (ok) fair.push_back(n);
+    }
+    if (fair.size() == nodes.size()) return nodes;
+    for (std::vector<size_t>& c : components(fair, edges, states.size())) {
+        std::vector<size_t> r = fair_component(c, edges, states);
+        if (!r.empty()) return r;
+    }
+    return std::vector<size_t>{};
+}
+
+// Shortest nonempty sequence of edges within `nodes`, starting at `from` and
+// ending with an edge satisfying `goal`
+static std::vector<LiveEdge> live_path(
+        size_t from, std::function<bool(const LiveEdge&)> goal,
+        const std::vector<size_t>& nodes, const std::vector<LiveEdge>& edges,
+        size_t count) {
+    std::vector<bool> in(count, false);
+    for (size_t n : nodes) in[n] = true;
+    std::vector<long> via(count, -1);
+    std::queue<size_t> queue;
+    std::vector<bool> seen(count, false);
+    seen[from] = true;
+    queue.push(from);
+    while (!queue.empty()) {
+        size_t u = queue.front();
+        queue.pop();
+        for (size_t k = 0; k < edges.size(); ++k) {
+            const LiveEdge& e = edges[k];
+            if (e.from != u || !in[e.to]) continue;
+            if (goal(e)) {
+                std::vector<LiveEdge> path{e};
+                for (size_t v = u; v != from; v = edges[via[v]].from) {
+                    path.push_back(edges[via[v]]);
+                }
+                std::reverse(path.begin(), path.end());
+                return path;
+            }
+            if (!seen[e.to]) {
+                seen[e.to] = true;
+                via[e.to] = k;
+                queue.push(e.to);
+            }
+        }
+    }
+    return std::vector<LiveEdge>{};
+}
+
+Result Model::run_liveness(const Predicate& eventually, int max_depth,
+                           bool print) {
+    Result res;
+    // The Tarjan stack, and where its states are
+    std::vector<LiveNode> tarjan;
+    LiveStore store;
+    std::vector<LiveFrame> stack;
+    size_t counter = 0;
+    size_t nodes_seen = 0;
+    size_t components_checked = 0;
+    bool truncated = false;
+    visited.clear();
+    visited.symmetries = nullptr;
+
+    // Enter a state reached by transition `k` of the top frame (if any),
+    // unless it satisfies the goal (in which case that path is fine) or has
+    // been seen; returns whether a frame was pushed
+    auto enter = [&] (const SystemState& s, Diff* d, size_t k) {
+        if (eventually.match(s) || visited.seen(s, false)) {
+            if (d) d->ref_dec();
+            return false;
+        }
+        FlatState key{s};
+        long at = store.find(s, key);
+        bool fresh = at < 0;
+        if (fresh) {
+            at = tarjan.size();
+            store.add(s, key, at);
+            tarjan.push_back(LiveNode{s, counter, counter, {}});
+            ++counter;
+            ++nodes_seen;
+        }
+        if (!stack.empty()) {
+            LiveNode& top = tarjan[stack.back().node];
+            long t = d->fired < 0 ? -1 : d->fired * MAX_TIMERS + d->timer;
+            // A delivered message is still pending in the state it's from
+            top.edges.push_back(LiveEdge{stack.back().node, (size_t) at, k,
+                                         d->delivered, t});
+            if (!fresh) top.low = std::min(top.low, tarjan[at].index);
+        }
+        if (!fresh) {
+            if (d) d->ref_dec();
+            return false;
+        }
+        stack.emplace_back(s, d, at);
+        return true;
+    };
+
+    for (const SystemState& root : pending) {
+        SystemState start{root};
+        start.depth = 0;
+        enter(start, nullptr, 0);
+
+        while (!stack.empty() && !cancelled(*this, res)) {
+            LiveFrame& f = stack.back();
+            if (!f.next && f.state.terminated()) {
+                // The system stops without ever reaching the goal
+                printf("LIVENESS VIOLATED: %s (terminates without it)\n",
+                       eventually.name);
+                SystemState trace = path_trace(root, stack);
+                trace.print_history();
+                if (record(*this, res, &eventually, trace)) break;
+            }
+
+            size_t k = f.next;
+            bool cut = max_depth >= 0 && f.state.depth >= max_depth;
+            if (cut && !f.next && !f.state.terminated()) truncated = true;
+            if (!cut && k < transitions(f.state)) {
+                ++f.next;
+                if (!enabled(*this, f.state, k)) continue;
+                Diff* d = new Diff();
+                SystemState next = successor<false>(*this, f.state, k, d);
+                // Careful: this may invalidate `f`
+                enter(next, d, k);
+                continue;
+            }
+
+            // Done with this state; if it roots a component, check it
+            size_t root_at = f.node;
+            size_t low = tarjan[root_at].low;
+            if (low == tarjan[root_at].index) {
+                // The component is the top of the Tarjan stack, from its root
+                // on; its edges were recorded as they were found
+                std::vector<const SystemState*> states;
+                std::vector<LiveEdge> edges;
+                for (size_t n = root_at; n < tarjan.size(); ++n) {
+                    states.push_back(&tarjan[n].state);
+                    for (const LiveEdge& e : tarjan[n].edges) {
+                        if (e.to < root_at) continue;
+                        edges.push_back(LiveEdge{e.from - root_at,
+                                                 e.to - root_at, e.k, e.msg,
+                                                 e.timer});
+                    }
+                }
+                ++components_checked;
+
+                std::vector<size_t> all(states.size());
+                for (size_t k = 0; k < all.size(); ++k) all[k] = k;
+                std::vector<size_t> fair = fair_component(all, edges, states);
+                if (!fair.empty()) {
+                    // Lead from the component's root into the fair part, then
+                    // around a cycle delivering every message pending in it
+                    std::set<size_t> members(fair.begin(), fair.end());
+                    std::vector<LiveEdge> lead;
+                    if (!in_set(members, 0)) {
+                        lead = live_path(0, [&] (const LiveEdge& e) {
+                            return in_set(members, e.to);
+                        }, all, edges, states.size());
+                    }
+                    size_t at = lead.empty() ? 0 : lead.back().to;
+                    std::vector<LiveEdge> cycle;
+                    std::set<Message*, MessageLess> todo;
+                    for (size_t n : fair) {
+                        todo.insert(states[n]->messages.begin(),
+                                    states[n]->messages.end());
+                    }
+                    size_t cur = at;
+                    for (Message* m : todo) {
+                        std::vector<LiveEdge> p = live_path(cur,
+                            [&] (const LiveEdge& e) {
+                                return e.msg && !e.msg->compare(m);
+                            }, fair, edges, states.size());
+                        cycle.insert(cycle.end(), p.begin(), p.end());
+                        if (!p.empty()) cur = p.back().to;
+                    }
+                    std::set<long> timers;
+                    for (size_t n : fair) {
+                        const SystemState& s = *states[n];
+                        for (size_t j = 0; j < s.machines.size(); ++j) {
+                            for (int t = 0; t < MAX_TIMERS; ++t) {
+                                if (s.machines[j]->armed(t)) {
+                                    timers.insert(j * MAX_TIMERS + t);
+                                }
+                            }
+                        }
+                    }
+                    for (long t : timers) {
+                        std::vector<LiveEdge> p = live_path(cur,
+                            [&] (const LiveEdge& e) { return e.timer == t; },
+                            fair, edges, states.size());
+                        cycle.insert(cycle.end(), p.begin(), p.end());
+                        if (!p.empty()) cur = p.back().to;
+                    }
+                    if (cur != at || cycle.empty()) {
+                        std::vector<LiveEdge> back = live_path(cur,
+                            [&] (const LiveEdge& e) { return e.to == at; },
+                            fair, edges, states.size());
+                        cycle.insert(cycle.end(), back.begin(), back.end());
+                    }
+
+                    auto replay = [&] (std::vector<LiveEdge>& part) {
+                        SystemState r{std::vector<Machine*>{}};
+                        for (LiveEdge& e : part) {
+                            Diff* d = new Diff();
+                            successor<false>(*this, *states[e.from], e.k, d);
+                            r.history.push_back(d);
+                        }
+                        return r;
+                    };
+                    printf("LIVENESS VIOLATED: %s (fair cycle without it)\n",
+                           eventually.name);
+                    path_trace(root, stack).print_history();
+                    if (!lead.empty()) {
+                        printf("Then, within the cycle's component:\n");
+                        replay(lead).print_history();
+                    }
+                    printf("Then, repeating forever:\n");
+                    replay(cycle).print_history();
+                    // The component is done with either way, so the search
+                    // can go on past it
+                    if (record(*this, res, &eventually,
+                               path_trace(root, stack))) {
+                        break;
+                    }
+                }
+                // Only visited is needed of the component's states from now
+                // on, as none can be in another component
+                for (size_t n = root_at; n < tarjan.size(); ++n) {
+                    visited.visit(tarjan[n].state);
+                    store.remove(tarjan[n].state);
+                }
+                tarjan.erase(tarjan.begin() + root_at, tarjan.end());
+            }
+
+            // Pop, propagating the low link to the parent
+            if (f.diff) f.diff->ref_dec();
+            stack.pop_back();
+            if (!stack.empty()) {
+                LiveNode& parent = tarjan[stack.back().node];
+                parent.low = std::min(parent.low, low);
+            }
+        }
+        for (LiveFrame& f : stack) {
+            if (f.diff) f.diff->ref_dec();
+        }
+        stack.clear();
+        if (res.stopped) break;
+    }
+
+    if (print) {
+        printf("Components checked: %lu\n    States stored: %lu\n",
+               components_checked, visited.size() + tarjan.size());
+    }
+    if (truncated) {
+        // A state first reached at the cut isn't expanded when it's reached
+        // again by a shorter path, so even some shallower cycles are missed
+        printf("Search was cut off at depth %d; the result only holds for "
+               "executions within it\n", max_depth);
+    }
+    printf("Total nodes explored: %lu\n", nodes_seen);
+    res.explored = nodes_seen;
+    return res;
+}
+
+struct TraceHeader {
+    // The start of a binary trace, followed by `steps` transitions (each a
+    // uint32_t)
+    char magic[4];
+    uint32_t version;
+    uint32_t fifo;
+    int32_t max_drops;
+    int32_t max_dups;
+    int32_t max_crashes;
+    // A hash of the initial state's flat encoding, or 0 if it has none (when
+    // a trace can still be read back by a differently initialized model)
+    uint64_t initial;
+    uint64_t steps;
+};
+
+static const char TRACE_MAGIC[4] = {'M', '+', '+', 'T'};
+static const uint32_t TRACE_VERSION = 2;
+
+// The header a trace of `model` starts with (but for the steps)
+static TraceHeader trace_header(const Model& model) {
+    TraceHeader h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, TRACE_MAGIC, sizeof h.magic);
+    h.version = TRACE_VERSION;
+    h.fifo = model.fifo;
+    h.max_drops = model.max_drops;
+    h.max_dups = model.max_dups;
+    h.max_crashes = model.max_crashes;
+    FlatState f{model.initial};
+    if (f.ok) h.initial = bytes_hash(f.buf.data(), f.buf.size());
+    return h;
+}
+
+bool Model::save_trace(const SystemState& s, const char* file) {
+    std::vector<uint32_t> steps;
+    SystemState at = initial;
+    for (Diff* const& d : s.history) {
+        size_t k = step_of(*this, at, d);
+        if (k == transitions(at)) {
+            fprintf(stderr, "%s: history doesn't follow from the initial "
+                    "state\n", file);
+            return false;
+        }
+        steps.push_back(k);
+        // Only the state is wanted, not the diff
+        Diff* e = new Diff();
+        SystemState next = successor<false>(*this, at, k, e);
+        e->ref_dec();
+        at = next;
+    }
+
+    TraceHeader h = trace_header(*this);
+    h.steps = steps.size();
+    FILE* f = fopen(file, "wb");
+    if (!f) {
+        perror(file);
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof h, 1, f) == 1
+        && fwrite(steps.data(), sizeof(uint32_t), steps.size(), f)
+            == steps.size();
+    if (fclose(f) || !ok) {
+        perror(file);
+        return false;
+    }
+    return true;
+}
+
+bool Model::load_trace(const char* file, std::vector<uint32_t>& steps) const {
+    FILE* f = fopen(file, "rb");
+    if (!f) {
+        perror(file);
+        return false;
+    }
+    TraceHeader h;
+    const char* err = nullptr;
+    if (fread(&h, sizeof h, 1, f) != 1
+        || memcmp(h.magic, TRACE_MAGIC, sizeof h.magic)) {
+        err = "not a trace";
+    } else if (h.version != TRACE_VERSION) {
+        err = "unsupported trace version";
+    } else {
+        TraceHeader want = trace_header(*this);
+        want.steps = h.steps;
+        if (memcmp(&h, &want, sizeof h)) {
+            err = "trace was written by a differently configured model";
+        } else {
+            steps.resize(h.steps);
+            if (fread(steps.data(), sizeof(uint32_t), steps.size(), f)
+                != steps.size()) {
+                err = "trace is truncated";
+            }
+        }
+    }
+    fclose(f);
+    if (err) fprintf(stderr, "%s: %s\n", file, err);
+    return !err;
+}
+
+Result Model::replay(const std::vector<uint32_t>& steps, bool print) {
+    Result res;
+    SystemState s = initial;
+    if (const Predicate* p = violated(invariants, s)) {
+        report(*this, res, p, s);
+        return res;
+    }
+    for (uint32_t k : steps) {
+        if (k >= transitions(s) || !enabled(*this, s, k)) {
+            printf("Trace step %d can't be taken\n", s.depth + 1);
+            res.stopped = true;
+            break;
+        }
+        Diff* d = new Diff();
+        SystemState next = successor<false>(*this, s, k, d);
+        next.history.push_back(d);
+        s = next;
+        ++res.explored;
+        if (const Predicate* p = violated(invariants, s, d)) {
+            report(*this, res, p, s);
+            break;
+        }
+    }
+    res.depth = s.depth;
+    if (s.terminated()) {
+        ++res.terminated;
+        if (keep_terminating) res.terminating.insert(s);
+    }
+    if (print) printf("Steps replayed: %lu\n", res.explored);
+    return res;
+}
+
+SystemState Model::minimize(const Violation& v, unsigned threads,
+                            bool print) {
+    if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<Walker::Step> path;
+    for (Diff* const& d : v.state.history) {
+        Action a = d->restarted >= 0 ? RESTART : d->fired >= 0 ? FIRE
+            : d->delivered ? DELIVER : d->dropped ? DROP : DUPLICATE;
+        Message* msg = d->delivered ? d->delivered
+            : d->dropped ? d->dropped : d->duplicated;
+        id_t j = a == RESTART ? d->restarted : a == FIRE ? d->fired : 0;
+        path.push_back(Walker::Step{a, msg, j, d->timer, 0});
+    }
+
+    // Whether `c` still violates the invariant; if so, it's cut down to the
+    // steps taken up to the violation
+    std::atomic<size_t> replays{0};
+    auto fails = [&] (Walker& w, std::vector<Walker::Step>& c) {
+        ++replays;
+        std::vector<Walker::Step> kept;
+        const Predicate* p = w.follow(c, *this, kept, false);
+        if (!p || strcmp(p->name, v.invariant.name)) return false;
+        c = std::move(kept);
+        return true;
+    };
+    {
+        Walker w{initial};
+        if (!fails(w, path)) {
+            if (print) {
+                printf("History can't be replayed to the violation, so it "
+                       "wasn't minimized\n");
+            }
+            return v.state;
+        }
+    }
+
+    size_t n = 2;
+    while (path.size() >= 2) {
+        size_t len = path.size();
+        n = std::min(n, len);
+        // Try keeping each of n chunks, then (if that's different) leaving
+        // each out
+        std::vector<std::vector<Walker::Step>> cand;
+        for (size_t j = 0; j < n; ++j) {
+            cand.emplace_back(path.begin() + j * len / n,
+                              path.begin() + (j + 1) * len / n);
+        }
+        for (size_t j = 0; n > 2 && j < n; ++j) {
+            cand.emplace_back(path.begin(), path.begin() + j * len / n);
+            cand.back().insert(cand.back().end(),
+                               path.begin() + (j + 1) * len / n, path.end());
+        }
+
+        // Candidates after one already known to fail needn't be replayed
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> first{cand.size()};
+        auto worker = [&] () {
+            Walker w{initial};
+            for (size_t c; (c = next++) < first.load();) {
+                if (!fails(w, cand[c])) continue;
+                size_t f = first.load();
+                while (c < f && !first.compare_exchange_weak(f, c)) {}
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned t = 1; t < std::min<size_t>(threads, cand.size()); ++t) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (std::thread& t : pool) t.join();
+
+        size_t c = first;
+        if (c < n) {
+            path = std::move(cand[c]);
+            n = 2;
+        } else if (c < cand.size()) {
+            path = std::move(cand[c]);
+            n = std::max<size_t>(n - 1, 2);
+        } else if (n >= len) {
+            break;
+        } else {
+            n = std::min(len, 2 * n);
+        }
+    }
+
+    // Rebuild the shrunk history as a standalone state
+    Walker w{initial};
+    std::vector<Walker::Step> kept;
+    w.follow(path, *this, kept, true);
+    if (print) {
+        printf("Minimized history from %lu to %lu steps\n"
+               "    Candidates replayed: %lu\n",
+               v.state.history.size(), path.size(), replays.load());
+    }
+    return w.trace();
 }
@@ -1,8 +1,15 @@
 #include <vector>
 #include <queue>
 #include <set>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
 #include <string>
 #include <functional>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +19,120 @@
 // Machine identifiers
 typedef unsigned id_t;
 
+// Append the raw bytes of `v` (which must be trivially copyable) to `out`
+template <typename T>
+inline void flat_put(std::string& out, const T& v) {
+    out.append((const char*) &v, sizeof v);
+}
+
+// Kernels over byte buffers (like FlatState's): a 64-bit hash, equality, and
+// a three-way comparison ordering as memcmp does. The hash uses AVX2 if the
+// CPU has it, chosen at startup, and otherwise a scalar fallback computing
+// the same value; bytes_kernels(false) switches to the scalar one (as
+// bench.cpp does to compare them), and bytes_kernels(true) back. Equality and
+// comparison use libc's memcmp, which picks its own vector code.
+uint64_t bytes_hash(const char* p, size_t n);
+bool bytes_equal(const char* a, const char* b, size_t n);
+int bytes_compare(const char* a, const char* b, size_t n);
+void bytes_kernels(bool vector);
+
+template <typename T>
+struct SharedLog final {
+    // An append-only sequence with value semantics, for machine state like a
+    // replicated log. Entries are linked back to the one before, and copies
+    // share them, so copying or appending is O(1) rather than O(size). Each
+    // entry caches a hash of the whole prefix up to it, so logs of the same
+    // size usually compare (unequal) in O(1) too; equal logs are only walked
+    // if they don't share their last entry. Order is by size, then hash, then
+    // entries, so it's total but not lexicographic. Like the other counters
+    // here, the sharing isn't thread safe.
+    struct Entry {
+        unsigned long refs;
+        Entry* prev;
+        size_t size;
+        uint64_t hash;
+        T value;
+    };
+
+    SharedLog() : last(nullptr) {}
+    SharedLog(const SharedLog& rhs) : last(rhs.last) {
+        if (last) ++last->refs;
+    }
+    SharedLog& operator=(const SharedLog& rhs) {
+        if (rhs.last) ++rhs.last->refs;
+        release(last);
+        last = rhs.last;
+        return *this;
+    }
+    ~SharedLog() {
+        release(last);
+    }
+
+    size_t size() const {
+        return last ? last->size : 0;
+    }
+    uint64_t hash() const {
+        return last ? last->hash : 0;
+    }
+
+    void push_back(const T& v) {
+        uint64_t h = (hash() ^ std::hash<T>{}(v)) * 0x9e3779b97f4a7c15UL;
+        last = new Entry{1, last, size() + 1, h ^ h >> 29, v};
+    }
+
+    const T& back() const {
+        return last->value;
+    }
+    // This walks back from the end, so costs O(size - i)
+    const T& operator[](size_t i) const {
+        Entry* e = last;
+        for (size_t n = size() - 1; n > i; --n) e = e->prev;
+        return e->value;
+    }
+
+    // Perform a three-way comparison (T must have operator<)
+    int compare(const SharedLog& rhs) const {
+        if (size() != rhs.size()) return size() < rhs.size() ? -1 : 1;
+        if (hash() != rhs.hash()) return hash() < rhs.hash() ? -1 : 1;
+        for (Entry *a = last, *b = rhs.last; a != b; a = a->prev, b = b->prev) {
+            if (a->value < b->value) return -1;
+            if (b->value < a->value) return 1;
+        }
+        return 0;
+    }
+    bool operator==(const SharedLog& rhs) const {
+        return !compare(rhs);
+    }
+    std::strong_ordering operator<=>(const SharedLog& rhs) const {
+        return compare(rhs) <=> 0;
+    }
+
+    // Append the size and then the entries, oldest first, to `out` (see
+    // FlatState); T must be trivially copyable
+    void flatten(std::string& out) const {
+        size_t n = size();
+        flat_put(out, n);
+        out.resize(out.size() + n * sizeof(T));
+        char* p = &out[out.size()];
+        for (Entry* e = last; e; e = e->prev) {
+            p -= sizeof(T);
+            memcpy(p, &e->value, sizeof(T));
+        }
+    }
+
+private:
+    Entry* last;
+
+    // Drop a reference to `e`, and so on back while they're unshared
+    static void release(Entry* e) {
+        while (e && !--e->refs) {
+            Entry* prev = e->prev;
+            delete e;
+            e = prev;
+        }
+    }
+};
+
 struct RefCounter {
     // A simple reference counter
 
@@ -40,9 +161,14 @@ struct Message : RefCounter {
     // may_drop should be uniquely determined by type, and thus is not
     // separately compared
     bool may_drop;
+    // Likewise for fifo: messages with it set are delivered (or dropped) in
+    // the order they were sent, relative to other such messages on the same
+    // (src, dst) channel, like over a TCP connection
+    bool fifo;
 
-    Message(id_t src, id_t dst, int type, bool may_drop = false)
-        : src(src), dst(dst), type(type), may_drop(may_drop) {}
+    Message(id_t src, id_t dst, int type, bool may_drop = false,
+            bool fifo = false)
+        : src(src), dst(dst), type(type), may_drop(may_drop), fifo(fifo) {}
 
     // Perform a three-way comparison of this message to `rhs`
     int compare(Message* rhs) const {
@@ -62,14 +188,172 @@ struct Message : RefCounter {
         return 0;
     }
 
+    // Append the added fields of subclasses to `out` (see FlatState), such
+    // that the bytes are equal exactly when sub_compare returns 0, and return
+    // true. Plain Messages have none; for a subclass that doesn't override
+    // it, this returns false, marking its type as having no flat encoding, so
+    // states holding one are compared whole instead (see Visited) and the
+    // features which can't do without one report an error.
+    virtual bool sub_flatten(std::string& out) const;
+
     // Print out extra information about this message (extra fields, etc)
     // Please indent 4 spaces in this function
     virtual void sub_print() const {}
 };
 
+struct MessageList final {
+    // A persistent sequence of messages (for the messages in flight): an AVL
+    // tree ordered by position, whose nodes each hold a run of up to CHUNK
+    // messages and are immutable, so they can be shared between copies.
+    // Copying a list is O(1), and indexing, inserting or erasing is O(log n),
+    // copying just the nodes on the path (the chunks keep that cheap when n is
+    // small). Unless `counted` is unset, each node holds a reference to each
+    // of its messages, so a list keeps what it holds alive; a list and its
+    // copies must agree on `counted`. (Random walks keep their messages in a
+    // plain vector instead, and only copy them into an uncounted list for
+    // invariants over whole states, as walker threads share messages.)
+    static const int CHUNK = 8;
+    struct Node {
+        unsigned long refs;
+        Node* left;
+        Node* right;
+        size_t size;
+        int height;
+        int count;
+        Message* msgs[CHUNK];
+    };
+
+    struct iterator {
+        // In order, keeping the path down to the current node and the index
+        // within it
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Message* value_type;
+        typedef ptrdiff_t difference_type;
+        typedef Message* const* pointer;
+        typedef Message* const& reference;
+
+        Node* path[64];
+        int n;
+        int j;
+
+        iterator() : path{}, n(0), j(0) {}
+        iterator(Node* t) : n(0), j(0) {
+            descend(t);
+        }
+
+        reference operator*() const {
+            return path[n - 1]->msgs[j];
+        }
+        iterator& operator++() {
+            if (++j < path[n - 1]->count) return *this;
+            j = 0;
+            descend(path[--n]->right);
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator it = *this;
+            ++*this;
+            return it;
+        }
+        bool operator==(const iterator& rhs) const {
+            return n == rhs.n && j == rhs.j
+                && (!n || path[n - 1] == rhs.path[n - 1]);
+        }
+
+    private:
+        void descend(Node* t) {
+            for (; t; t = t->left) path[n++] = t;
+        }
+    };
+
+    MessageList(bool counted = true) : root(nullptr), counted(counted) {}
+    MessageList(const MessageList& rhs)
+        : root(share(rhs.root)), counted(rhs.counted) {}
+    MessageList& operator=(const MessageList& rhs) {
+        Node* t = share(rhs.root);
+        release(root, counted);
+        root = t;
+        counted = rhs.counted;
+        return *this;
+    }
+    MessageList(MessageList&& rhs)
+        : root(rhs.root), counted(rhs.counted) {
+        rhs.root = nullptr;
+    }
+    MessageList& operator=(MessageList&& rhs) {
+        std::swap(root, rhs.root);
+        std::swap(counted, rhs.counted);
+        return *this;
+    }
+    ~MessageList() {
+        release(root, counted);
+    }
+
+    size_t size() const {
+        return root ? root->size : 0;
+    }
+    bool empty() const {
+        return !root;
+    }
+    Message* operator[](size_t i) const;
+    Message* front() const {
+        return (*this)[0];
+    }
+    iterator begin() const {
+        return iterator{root};
+    }
+    iterator end() const {
+        return iterator{};
+    }
+    // Whether this is a copy of `rhs` (so certainly equal)
+    bool shares(const MessageList& rhs) const {
+        return root == rhs.root;
+    }
+
+    void push_back(Message* m) {
+        insert(size(), m);
+    }
+    // Insert `m` before message `i`
+    void insert(size_t i, Message* m);
+    void erase(size_t i);
+    void clear() {
+        release(root, counted);
+        root = nullptr;
+    }
+
+private:
+    // A run of messages to put in a node
+    struct Chunk {
+        Message* const* msgs;
+        int count;
+    };
+
+    Node* root;
+    bool counted;
+
+    static Node* share(Node* t) {
+        if (t) ++t->refs;
+        return t;
+    }
+    static Chunk chunk(const Node* t) {
+        return Chunk{t->msgs, t->count};
+    }
+    static void release(Node* t, bool counted);
+    // Each of these returns a new reference, and takes over the references to
+    // any subtrees passed in (but not those they only read)
+    Node* make(Node* l, Chunk c, Node* r) const;
+    Node* balance(Node* l, Chunk c, Node* r) const;
+    Node* add(Node* t, size_t i, Message* m) const;
+    Node* remove(Node* t, size_t i) const;
+    Node* remove_first(Node* t) const;
+};
+
 // Can define additional errors here
 #define ERR_BADMSG  1
 
+// Timers are named by integers below this
+#define MAX_TIMERS  32
+
 struct Machine : RefCounter {
     // A Machine is the base class for state machines in the system. Subclasses
     // may add mutable state. Like messages, they are parameterized by a type
@@ -78,13 +362,27 @@ struct Machine : RefCounter {
     id_t id;
     int type;
     int error;
+    // Machines with may_crash set may crash and restart (see on_restart); like
+    // Message::may_drop, it should be determined by type, and is not compared
+    bool may_crash;
+    // The set of armed timers, one bit per name
+    unsigned timers;
 
-    Machine(id_t id, int type) : id(id), type(type), error(0) {}
+    Machine(id_t id, int type, bool may_crash = false)
+        : id(id), type(type), error(0), may_crash(may_crash), timers(0) {}
 
     // A machine must be cloneable to allow for mutation. Subclasses must
-    // implement this method such that `compare(clone()) == 0`.
+    // implement this method such that `compare(clone()) == 0`, except for the
+    // timers, which the model checker copies itself (see copy).
     virtual Machine* clone() const = 0;
 
+    // Clone, along with the timers
+    Machine* copy() const {
+        Machine* m = clone();
+        m->timers = timers;
+        return m;
+    }
+
     // Perform a three-way comparison of this machine to `rhs`
     int compare(Machine* rhs) const {
         if (int r = (int) id - rhs->id) return r;
@@ -94,12 +392,38 @@ struct Machine : RefCounter {
     // Similar, but ignore id (for symmetry optimization)
     int logical_compare(Machine* rhs) const {
         if (int r = type - rhs->type) return r;
+        if (timers != rhs->timers) return timers < rhs->timers ? -1 : 1;
         return sub_compare(rhs);
     }
 
+    // Timers are armed and cancelled by handlers; an armed timer may fire at
+    // any time, disarming it and calling on_timer. Rearming (in on_timer) makes
+    // it periodic.
+    void arm(int t) {
+        timers |= 1u << t;
+    }
+    void cancel(int t) {
+        timers &= ~(1u << t);
+    }
+    bool armed(int t) const {
+        return timers >> t & 1;
+    }
+
     // Perform comparison on added fields in subclasses
     virtual int sub_compare(Machine* rhs) const = 0;
 
+    // Likewise for flattening (used by flat states, declared symmetries and
+    // counting terminating states without keeping them); unless overridden,
+    // the type has no flat encoding
+    virtual bool sub_flatten(std::string& out) const {
+        return false;
+    }
+
+    // Rename the machine ids held in added fields, each id i becoming to[i]
+    // (only needed if they may name a machine in one of the model's
+    // symmetries; see Model::symmetries)
+    virtual void sub_remap(const std::vector<id_t>& to) {}
+
     // On startup a machine might manipulate its own state, then return a vector
     // of messages it emits on initialization.
     virtual std::vector<Message*> on_startup() {
@@ -113,28 +437,51 @@ struct Machine : RefCounter {
     virtual std::vector<Message*> handle_message(Message* msg) {
         return std::vector<Message*>{};
     }
+
+    // When a machine crashes and restarts, it should reset whatever state
+    // would be lost in a crash, then return a vector of messages it emits on
+    // recovery (like on_startup). By default nothing is lost or sent.
+    virtual std::vector<Message*> on_restart() {
+        return std::vector<Message*>{};
+    }
+
+    // When timer `t` fires, a machine may likewise update its state and return
+    // a vector of messages to emit
+    virtual std::vector<Message*> on_timer(int t) {
+        return std::vector<Message*>{};
+    }
 };
 
 struct Diff : RefCounter {
     // A Diff captures the change between two states, which may only be caused
-    // by a message being delivered or dropped (and if a message is delivered,
-    // more may be sent)
+    // by a message being delivered, dropped or duplicated, by a machine
+    // restarting, or by a timer firing (and unless a message is dropped or
+    // duplicated, more may be sent)
     std::vector<Message*> sent;
     Message* delivered;
     Message* dropped;
+    Message* duplicated;
+    // The machine which restarted, or -1
+    long restarted;
+    // The machine whose timer fired (or -1), and which timer
+    long fired;
+    int timer;
 
-    Diff() : delivered(nullptr), dropped(nullptr) {}
+    Diff()
+        : delivered(nullptr), dropped(nullptr), duplicated(nullptr),
+          restarted(-1), fired(-1), timer(0) {}
 
     ~Diff() {
         for (Message*& m : sent) m->ref_dec();
         if (delivered) delivered->ref_dec();
         if (dropped) dropped->ref_dec();
+        if (duplicated) duplicated->ref_dec();
     }
 };
 
 struct SystemState final {
     // Together, messages and machines constitute the state of a system
-    std::vector<Message*> messages;
+    MessageList messages;
     std::vector<Machine*> machines;
     // States also store an ordered list of diffs, which constitute a method to
     // arrive at this state from the initial state
@@ -142,10 +489,37 @@ struct SystemState final {
 
     // 1 + the prececessor's depth
     int depth;
+    // The number of older messages skipped over by the deliveries and drops
+    // in this state's history (messages are kept oldest first)
+    int delay;
+    // The faults (drops, duplications and restarts) in this state's history,
+    // each only counted if the model bounds it. Unlike the delay, these are
+    // part of the state, so states with less budget left aren't mistaken for
+    // ones with more.
+    int drops;
+    int dups;
+    int crashes;
+
+    // The pending messages to and from each machine, in the order LogicalState
+    // wants them (unless every message is treated as fifo): all others sorted
+    // by value, then fifo ones grouped by channel in the order they were sent.
+    // They're only kept (then up to date as messages are sent and taken) once
+    // turned on with bucket, which the searches do when excluding symmetries
+    // by LogicalState; otherwise both are empty. They should only be read.
+    std::vector<MessageList> incoming;
+    std::vector<MessageList> outgoing;
 
     // Initialize with a machine list.
     SystemState(std::vector<Machine*> machines)
-        : machines(machines), depth(0) {}
+        : machines(machines), depth(0), delay(0), drops(0), dups(0),
+          crashes(0) {}
+
+    // Start (or stop) keeping the buckets
+    void bucket(bool on);
+    // Add `m` as the newest message
+    void send(Message* m);
+    // Remove message `i`
+    void take(size_t i);
 
     // When we explore the state graph, we deep copy the SystemState. This
     // copies the vectors of pointers, but does not copy the underlying machines
@@ -154,12 +528,33 @@ struct SystemState final {
     // get_neighbors implementation.
     SystemState(const SystemState& rhs) {
         messages = rhs.messages;
-        for (Message*& m : messages) m->ref_inc();
+        incoming = rhs.incoming;
+        outgoing = rhs.outgoing;
         machines = rhs.machines;
         for (Machine*& m : machines) m->ref_inc();
         history = rhs.history;
         for (Diff*& d : history) d->ref_inc();
         depth = rhs.depth;
+        delay = rhs.delay;
+        drops = rhs.drops;
+        dups = rhs.dups;
+        crashes = rhs.crashes;
+    }
+
+    // Assignment has to take references the same way (so copy, then swap)
+    SystemState& operator=(const SystemState& rhs) {
+        SystemState copy{rhs};
+        std::swap(messages, copy.messages);
+        std::swap(incoming, copy.incoming);
+        std::swap(outgoing, copy.outgoing);
+        std::swap(machines, copy.machines);
+        std::swap(history, copy.history);
+        depth = copy.depth;
+        delay = copy.delay;
+        drops = copy.drops;
+        dups = copy.dups;
+        crashes = copy.crashes;
+        return *this;
     }
 
     // Print a trace of what transpired
@@ -176,22 +571,79 @@ struct SystemState final {
                        d->dropped->src, d->dropped->type);
                 d->dropped->sub_print();
             }
+            if (d->duplicated) {
+                printf("Message from %u (type %d) duplicated\n",
+                       d->duplicated->src, d->duplicated->type);
+                d->duplicated->sub_print();
+            }
+            if (d->restarted >= 0) {
+                printf("Machine %ld crashed and restarted\n", d->restarted);
+            }
+            if (d->fired >= 0) {
+                printf("Timer %d of machine %ld fired\n", d->timer, d->fired);
+            }
+        }
+    }
+
+    // Whether nothing more can happen: no messages are pending and no timers
+    // are armed
+    bool terminated() const {
+        return terminated(messages, machines);
+    }
+
+    // Whether message `i` may be delivered or dropped now: a fifo message (or
+    // any message, if `all_fifo`) must wait for every earlier fifo message on
+    // its channel. Messages are kept in the order they were sent.
+    bool deliverable(size_t i, bool all_fifo) const {
+        return deliverable(messages, i, all_fifo);
+    }
+
+    // The same, for any sequence of pending messages (such as the plain
+    // vector a random walk keeps)
+    template <typename List>
+    static bool terminated(const List& messages,
+                           const std::vector<Machine*>& machines) {
+        if (!messages.empty()) return false;
+        for (Machine* const& m : machines) {
+            if (m->timers) return false;
+        }
+        return true;
+    }
+    template <typename List>
+    static bool deliverable(const List& messages, size_t i, bool all_fifo) {
+        Message* m = messages[i];
+        if (!all_fifo && !m->fifo) return true;
+        auto it = messages.begin();
+        for (size_t j = 0; j < i; ++j, ++it) {
+            Message* o = *it;
+            if ((all_fifo || o->fifo) && o->src == m->src && o->dst == m->dst)
+                return false;
         }
+        return true;
     }
 
     // SystemStates are comparable so we can skip visited states; the history
-    // is deliberately not included so states compare equal even if they have
-    // a different history
+    // (and so the delay) is deliberately not included so states compare equal
+    // even if they have a different history
     int compare(const SystemState* rhs) const {
         if (long r = (long) messages.size() - rhs->messages.size()) return r;
-        for (size_t i = 0; i < messages.size(); ++i) {
-            if (int r = messages[i]->compare(rhs->messages[i])) return r;
+        if (!messages.shares(rhs->messages)) {
+            for (auto a = messages.begin(), b = rhs->messages.begin();
+                 a != messages.end(); ++a, ++b) {
+                if (*a == *b) continue;
+                if (int r = (*a)->compare(*b)) return r;
+            }
         }
         if (long r = (long) machines.size() - rhs->machines.size()) return r;
+        // States reached from a common one share the machines no step has
+        // changed since, which needn't be compared
         for (size_t i = 0; i < machines.size(); ++i) {
+            if (machines[i] == rhs->machines[i]) continue;
             if (int r = machines[i]->compare(rhs->machines[i])) return r;
         }
-        return 0;
+        if (int r = drops - rhs->drops) return r;
+        if (int r = dups - rhs->dups) return r;
+        return crashes - rhs->crashes;
     }
     bool operator==(const SystemState& rhs) const {
         return !compare(&rhs);
@@ -203,19 +655,296 @@ struct SystemState final {
     // The builtin destructor will destroy the vectors, but we have to decrement
     // all their counters (since they're pointers that may be shared)
     ~SystemState() {
-        for (Message*& m : messages) m->ref_dec();
         for (Machine*& m : machines) m->ref_dec();
         for (Diff*& d : history) d->ref_dec();
     }
 };
 
+struct FlatState final {
+    // A SystemState's machines, messages and fault counts serialized into one
+    // contiguous buffer: the number of machines and of messages, a table of
+    // offsets to each machine's and then each message's record, the records
+    // (each padded to 8 bytes) and finally the fault counts. Two states compare
+    // equal exactly when their buffers do, so copying is a single allocation
+    // and comparison a memcmp. The history and delay aren't included.
+    std::string buf;
+    // Unset if some machine or message has no flat encoding (see
+    // Machine::sub_flatten), when `buf` is empty and mustn't be compared
+    bool ok;
+
+    // An encoding of a state that has none
+    FlatState() : ok(false) {}
+    // Encode `s`, with each machine id i renamed to to[i] if `to` is given:
+    // machine j goes in position to[j], and is encoded from a copy given the
+    // new id and remapped (see Machine::sub_remap)
+    FlatState(const SystemState& s,
+              const std::vector<id_t>& to = std::vector<id_t>{});
+
+    bool operator==(const FlatState& rhs) const {
+        return buf.size() == rhs.buf.size()
+            && bytes_equal(buf.data(), rhs.buf.data(), buf.size());
+    }
+};
+
+struct Arena final {
+    // A bump allocator that any number of threads may allocate from at once.
+    // Nothing is freed until the arena is cleared (when no thread is using
+    // it) or destroyed.
+    struct Block {
+        Block* prev;
+        size_t cap;
+        std::atomic<size_t> used;
+        alignas(8) char data[];
+    };
+    std::atomic<Block*> top;
+
+    Arena() : top(nullptr) {}
+    ~Arena() {
+        clear();
+    }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Return `n` bytes, aligned to 8
+    char* alloc(size_t n);
+    void clear();
+};
+
+struct StateTable final {
+    // A lock-free set of flat states, which any number of threads may search
+    // and insert into at once. The states themselves are copied into an arena
+    // as records; the table is open addressed (probing linearly) over 64-bit
+    // slots, each holding a record's address and the top 16 bits of its hash,
+    // so most mismatches are rejected without touching the record. A slot is
+    // claimed with a single compare-and-swap.
+    //
+    // When a table is 3/4 full, a table twice its size is chained after it and
+    // its records are moved over in chunks by whichever threads are inserting
+    // meanwhile; nobody waits for the move to finish. To move a slot it is
+    // either sealed (if empty) or copied onward, and an insert that probes a
+    // sealed slot carries on into the next table. Slots only ever go from empty
+    // to full or to sealed, so a state already present is always found on its
+    // probe path before any sealed slot, and is never inserted twice.
+    //
+    // Once all its records have moved on, a table is retired: searches start
+    // past it, but may still be reading it. Each search and insert counts
+    // itself in `active` while it runs, and the last one out frees the retired
+    // tables if none has started since, since any later one can't reach them.
+    struct Record {
+        uint64_t hash;
+        // The least delay the state has been reached with
+        std::atomic<int> delay;
+        uint32_t size;
+        alignas(8) char bytes[];
+    };
+    struct Table {
+        size_t mask;
+        std::atomic<uint64_t>* slots;
+        std::atomic<Table*> next;
+        // Slots filled, chunks claimed for moving and chunks moved
+        std::atomic<size_t> used;
+        std::atomic<size_t> claimed;
+        std::atomic<size_t> moved;
+        // The table retired before this one, once this one is
+        Table* below;
+
+        Table(size_t size);
+        ~Table() {
+            delete[] slots;
+        }
+        size_t chunks() const {
+            return (mask >> CHUNK_BITS) + 1;
+        }
+    };
+    static const int CHUNK_BITS = 10;
+    static const size_t INITIAL_SIZE = 1 << 16;
+
+    // The oldest table whose records haven't all been moved on, where
+    // searches start; none is allocated until the first insert, since most
+    // searches never use one. The tables retired before it are stacked in
+    // `retired` until they can be freed.
+    std::atomic<Table*> oldest;
+    mutable std::atomic<Table*> retired;
+    // The searches and inserts running
+    mutable std::atomic<size_t> active;
+    std::atomic<size_t> count;
+    Arena arena;
+
+    StateTable() : oldest(nullptr), retired(nullptr), active(0), count(0) {}
+    ~StateTable();
+    StateTable(const StateTable&) = delete;
+    StateTable& operator=(const StateTable&) = delete;
+
+    // The record of `s`, or nullptr if it isn't in the set
+    Record* find(const FlatState& s) const;
+    // Insert `s` (reached with `delay`) unless it's already there. Returns its
+    // record, and whether it was added.
+    std::pair<Record*, bool> insert(const FlatState& s, int delay);
+
+    size_t size() const {
+        return count.load(std::memory_order_relaxed);
+    }
+    // Empty the set; unlike everything else, not safe to call concurrently
+    void clear();
+
+private:
+    // Counts a search or insert in `active` while in scope
+    struct Use;
+    // The oldest table, allocating the first if there's none yet
+    Table* start();
+    // Put the slot value `v` (of a record hashed to `hash`) in the first table
+    // from `t` on with room, unless an equal record is found first. Returns
+    // the slot value that's there.
+    uint64_t place(Table* t, uint64_t hash, uint64_t v, const FlatState* s);
+    // Chain a bigger table after `t` if none has been yet
+    void grow(Table* t);
+    // Move a chunk of the records of any table that is being moved
+    void help();
+    // Move the oldest table past any whose records have all moved on
+    void retire();
+    // Leave a search or insert, freeing the retired tables if it's the last
+    void leave() const;
+    void free_tables();
+};
+
+struct Visited final {
+    // The set of visited states, each kept with the least delay it was reached
+    // with. If `flat` is set, only the states' flat encodings are kept; they
+    // go in a StateTable, so may be shared by concurrent searches. States
+    // without one (see Machine::sub_flatten) are kept whole in `states`
+    // instead, and so are up to symmetry, but without any reduction.
+    bool flat;
+    std::set<SystemState> states;
+    StateTable flats;
+    // If set, states are only told apart up to these symmetries (see
+    // Model::symmetries): each is kept in `flats` (whether or not `flat` is
+    // set) under its canonical encoding
+    const std::vector<std::vector<id_t>>* symmetries;
+
+    Visited() : flat(false), symmetries(nullptr) {}
+
+    // The encoding `s` is kept under, if flat or canonical
+    FlatState key(const SystemState& s) const;
+    // Whether `s` needn't be explored again: it has been visited, and (if
+    // delays are bounded) with no more delay than it has now, so it had at
+    // least as much budget left over
+    bool seen(const SystemState& s, bool bounded) const;
+    // Likewise, for a state with the given key and delay
+    bool seen(const FlatState& key, int delay, bool bounded) const;
+    // Mark `s` as visited, keeping the least delay it has been reached with
+    void visit(const SystemState& s);
+
+    size_t size() const {
+        return flats.size() + states.size();
+    }
+    void clear() {
+        states.clear();
+        flats.clear();
+    }
+};
+
 struct Predicate final {
-    // Named predicates over system states
+    // Named predicates over system states. One which holds of a state exactly
+    // when it holds of each machine (or each pending message) may instead be
+    // given as a predicate over those; the searches then only check it on the
+    // machine and messages each step changes or sends, rather than the whole
+    // state, while `match` still checks the whole state. One which only a
+    // change to some machine can break, but which looks at the others to tell,
+    // may be given as a check of machine `j` among all of them; it holds when
+    // the check holds for each machine, and is likewise only checked for the
+    // machine a step changes.
     const char* name;
     std::function<bool(const SystemState&)> match;
+    std::function<bool(Machine*)> machine;
+    std::function<bool(Message*)> message;
+    std::function<bool(const std::vector<Machine*>&, id_t)> among;
 
     Predicate(const char* s, std::function<bool(const SystemState&)> fn)
         : name(s), match(fn) {}
+    Predicate(const char* s, std::function<bool(Machine*)> fn)
+        : name(s), machine(fn) {
+        match = [fn] (const SystemState& st) {
+            for (Machine* const& m : st.machines) {
+                if (!fn(m)) return false;
+            }
+            return true;
+        };
+    }
+    Predicate(const char* s,
+              std::function<bool(const std::vector<Machine*>&, id_t)> fn)
+        : name(s), among(fn) {
+        match = [fn] (const SystemState& st) {
+            for (id_t j = 0; j < st.machines.size(); ++j) {
+                if (!fn(st.machines, j)) return false;
+            }
+            return true;
+        };
+    }
+    Predicate(const char* s, std::function<bool(Message*)> fn)
+        : name(s), message(fn) {
+        match = [fn] (const SystemState& st) {
+            for (Message* m : st.messages) {
+                if (!fn(m)) return false;
+            }
+            return true;
+        };
+    }
+};
+
+struct HandlerStats {
+    // Counters for one (machine type, message type) pair
+    unsigned long calls = 0;
+    unsigned long handle_ns = 0;
+    unsigned long clone_ns = 0;
+    unsigned long sent = 0;
+    unsigned long unchanged = 0;
+};
+
+struct Profile final {
+    // Per-handler statistics gathered in the transition loop, keyed on
+    // (Machine::type, Message::type). Only filled in when profiling is enabled,
+    // otherwise the instrumentation is compiled out of the loop entirely.
+    std::map<std::pair<int, int>, HandlerStats> handlers;
+
+    static unsigned long now() {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec * 1000000000UL + t.tv_nsec;
+    }
+
+    // Print a table of all the counters, one row per handler
+    void print() const;
+};
+
+struct Violation final {
+    // An invariant (or, for run_liveness, the goal) and a state which
+    // violates it, whose history leads there from the initial state. The
+    // predicate is a copy, so it outlives whatever it was passed as.
+    Predicate invariant;
+    SystemState state;
+};
+
+struct Result final {
+    // The outcome of a search: the violations found, each printed with its
+    // history as it's found (and each state only once), whether the search
+    // stopped early (having found Model::max_violations, or been cancelled),
+    // and statistics. Violating states are not expanded, so the search goes
+    // on around them.
+    std::vector<Violation> violations;
+    bool stopped = false;
+    // The distinct terminating states reached (unless the model doesn't keep
+    // them; the depth-first searches keep them without their histories), and
+    // how many there were
+    std::set<SystemState> terminating;
+    size_t terminated = 0;
+    // States explored (for simulate, steps taken), and the deepest depth
+    // searched
+    size_t explored = 0;
+    int depth = 0;
+
+    bool ok() const {
+        return violations.empty();
+    }
 };
 
 struct Model final {
@@ -223,23 +952,186 @@ struct Model final {
     // It also has a set of invariants evaluated at each state, and a history
     // to arrive at each state.
     std::vector<SystemState> pending;
-    std::set<SystemState> visited;
+    // The initial state, which every history starts from
+    SystemState initial;
+    Visited visited;
     std::vector<Predicate> invariants;
+    // If set, instrument each handle_message and clone call; the results are
+    // accumulated in `profile` and printed at the end of a run
+    bool profiling;
+    Profile profile;
+    // If non-negative, successors whose total delay exceeds this are pruned
+    int delay_bound;
+    // If set, treat every message as fifo (see Message)
+    bool fifo;
+    // Fault budgets: at most this many drops, duplications (of messages which
+    // may be dropped) and crash/restarts (of machines which may crash) along
+    // any history, or -1 for no bound. Defaults to unbounded drops and none
+    // of the others.
+    int max_drops;
+    int max_dups;
+    int max_crashes;
+    // Groups of interchangeable machines, like scalarsets: permuting the ids
+    // within any group (in the machines, their messages' src and dst, and ids
+    // machines hold, through sub_remap) must map every state to an equivalent
+    // one, so messages may only name group members by src and dst. When any
+    // are declared, excluding symmetries identifies states with the same
+    // canonical encoding, found by refining per-machine hashes (states with
+    // no flat encoding are only told apart whole); otherwise it compares
+    // LogicalStates, which ignore ids and so treat every machine as
+    // interchangeable (and breadth-first, only within a layer).
+    std::vector<std::vector<id_t>> symmetries;
+    // Searches stop once they've found this many violations (0 for no limit),
+    // by setting `cancel`. It's checked between states, by every thread or
+    // process of a search, so setting it from elsewhere (a signal handler, or
+    // a driver's thread) stops one cleanly too; it has to be cleared again
+    // before the next search.
+    size_t max_violations;
+    std::atomic<bool> cancel;
+    // Called with each distinct terminating state a search reaches, so
+    // callers can summarize them as they go. The depth-first searches pass
+    // it without its history; simulation doesn't call it, and a distributed
+    // search calls it in the worker processes.
+    std::function<void(const SystemState&)> on_terminal;
+    // If unset, the terminating states aren't kept in the Result, only
+    // counted (told apart by their flat encodings, which are kept instead,
+    // or whole if they have none)
+    bool keep_terminating;
 
     // Initialize a model with an initial state (a vector of machines) and
     // possibly invariants
     Model(std::vector<Machine*> m,
           std::vector<Predicate> i = std::vector<Predicate>{});
 
-    // Model check until a maximum depth (-1 for indefinitely). If `max_depth`
-    // is non-negative, checking stops at that depth and all pending states
-    // are returned. Otherwise, model checking continues until all new states
-    // have been visited, and a list of terminating states is returned. If
-    // `exclude_symmetries` is true, use the symmetry removing optimization.
-    // If `interesting_states` has members, check every state against the list
-    // and start over from any state which matches
-    std::set<SystemState> run(int max_depth = -1,
-        bool exclude_symmetries = true,
-        std::vector<Predicate> interesting_states = std::vector<Predicate>{},
+    // Model check until a maximum depth (-1 for indefinitely), or until all
+    // new states have been visited, returning the terminating states found
+    // (see Result). If `exclude_symmetries` is true, use the symmetry
+    // removing optimization (see `symmetries`).
+    Result run(int max_depth = -1, bool exclude_symmetries = true,
+               bool print = true);
+
+    // Run with delay bounds of 0 through `max_delay` in turn, starting over
+    // from the initial state each time, so the first violation found needs
+    // the fewest out-of-order deliveries. A delivery (or drop) of a message
+    // costs the number of older messages still pending. Returns what was
+    // found under any bound.
+    Result run_delay_bounded(int max_delay, int max_depth = -1,
+                             bool exclude_symmetries = true,
+                             bool print = true);
+
+    // Model check breadth-first as `run` does (without symmetry), but split
+    // over `workers` processes (0 for one per core), forked from this one and
+    // connected by Unix sockets. Each owns the states whose flat encodings
+    // (see FlatState; a state without one is an error) hash to it, keeps
+    // them as the visited set, and expands them with the same neighbor
+    // generation as `run`; successors owned by another worker are sent to it
+    // in one batch per layer, as the path of transitions from the initial
+    // state, which it replays (taking time proportional to the depth, so
+    // each layer's successors are deduped before they're sent, and again
+    // once received). This process coordinates: it starts each layer once
+    // every worker has finished the last, and stops when no worker has
+    // states left, at `max_depth`, or once stopped. Workers send it the paths
+    // to violating states, which it replays to report them.
+    Result run_distributed(unsigned workers = 0, int max_depth = -1,
+                           bool print = true);
+
+    // Model check best-first: states with the highest `score`, less
+    // `depth_weight` times their depth, are expanded first (so a positive
+    // weight gives an A*-like search which still favors short histories).
+    // Visited states and histories are kept as in `run`, so no work is
+    // thrown away, but histories need not be minimal. States at `max_depth`
+    // (if non-negative) are checked but not expanded.
+    Result run_guided(
+        std::function<long(const SystemState&)> score, long depth_weight = 0,
+        int max_depth = -1, bool exclude_symmetries = true,
         bool print = true);
+
+    // Model check by iterative deepening depth-first search, up to a maximum
+    // depth (-1 for indefinitely). Only the current path is kept in memory,
+    // along with the flat encodings of at most `cache_size` visited states,
+    // so memory grows with the depth rather than with the number of states.
+    // Checks the same invariants as `run`, and collects the distinct
+    // terminating states reached as the other searches do.
+    Result run_dfs(int max_depth = -1, size_t cache_size = 0,
+                   bool print = true);
+
+    // Model check statelessly with dynamic partial-order reduction, up to a
+    // maximum depth (-1 for indefinitely). Deliveries to the same machine are
+    // the only dependent transitions; orderings of independent deliveries are
+    // explored once, and two deliveries to a machine are only reordered if
+    // they race (neither happens-before the other, and delivering them in
+    // either order sends messages or gives a different machine). No visited
+    // set is kept. Every terminating state is still reached (and collected,
+    // as run_dfs does), but invariants are only evaluated on the
+    // interleavings actually explored, so they should not depend on the
+    // relative order of deliveries to different machines. Duplications,
+    // restarts and timers are not explored.
+    Result run_dpor(int max_depth = -1, bool print = true);
+
+    // Simulate `walks` random executions from the initial state, each of at
+    // most `length` steps, checking invariants after every step. Walk `w`
+    // picks its transitions with seed `seed + w`, so a violating walk (which
+    // is reported along with its seed) can be replayed by simulating a single
+    // walk from that seed. Walks are spread across `threads` threads (0 for
+    // one per core), which stop once `max_violations` walks have violated an
+    // invariant; the violating walks with the lowest seeds are then replayed
+    // to report them. Counts the walks that reached a terminating state. If
+    // `visited` is flat, it is cleared, and the threads insert every state they
+    // walk through into it at once, so its size is how many distinct states
+    // the walks covered.
+    Result simulate(size_t walks, int length, unsigned long seed,
+                    unsigned threads = 0, bool print = true);
+
+    // Check that every fair execution eventually reaches a state satisfying
+    // `eventually`. An execution is fair if every message (by value) that is
+    // pending infinitely often is also delivered infinitely often, and every
+    // timer armed infinitely often also fires infinitely often, so drops and
+    // timers may repeat forever but can't starve a message. States which
+    // don't satisfy `eventually` are searched depth-first, with strongly
+    // connected components found on the fly (Tarjan's algorithm), and the
+    // transitions within them recorded as they're found; each completed
+    // component is checked for a fair cycle, and its states then only kept in
+    // `visited` (which is cleared first, and doesn't use symmetries). A
+    // violation is either such a cycle or a terminating state, and is printed
+    // as a path followed by the repeating cycle (only the path is kept in the
+    // Result). States at `max_depth` (if non-negative) are not
+    // expanded, in which case only cycles within that depth are found, and
+    // not necessarily all of them: visited states are shared between paths,
+    // so one first reached at the cut isn't expanded when reached again by a
+    // shorter path. A note is printed when the cut was hit.
+    Result run_liveness(const Predicate& eventually, int max_depth = -1,
+                        bool print = true);
+
+    // Write the history of `s` to `file` as a binary trace: the transitions
+    // taken from the initial state (numbered as the searches number them,
+    // and found by matching each step by value), after a header with the
+    // network semantics, fault budgets and a hash of the initial state (if
+    // it has a flat encoding). It
+    // can only be read back by a model built and configured the same way.
+    // Returns whether it was written.
+    bool save_trace(const SystemState& s, const char* file);
+
+    // Read a trace written by save_trace into `steps`, returning whether it
+    // could be (and was written by a model like this one)
+    bool load_trace(const char* file, std::vector<uint32_t>& steps) const;
+
+    // Take `steps` from the initial state, checking the invariants after each
+    // as the searches do, but without searching. Stops at the first violation
+    // (reported as usual), or at a step which can't be taken (printed, and
+    // leaving the Result stopped without a violation).
+    Result replay(const std::vector<uint32_t>& steps, bool print = true);
+
+    // Shrink the history of a violation by delta debugging: replay
+    // candidates with parts of it left out (each step matched by value, as
+    // for save_trace, and skipping any which then can't be taken, along with
+    // the deliveries of what they would have sent), keeping any which still
+    // violate the same invariant, until leaving out any single step no
+    // longer does. Each round's
+    // candidates are replayed in parallel across `threads` threads (0 for one
+    // per core), and the first of them (in a fixed order) to still fail is
+    // kept, so the result doesn't depend on the threads. Returns the
+    // violating state at the end of the shrunk history, or `v`'s own state if
+    // its history can't be replayed to the violation (as for liveness).
+    SystemState minimize(const Violation& v, unsigned threads = 0,
+                         bool print = true);
 };
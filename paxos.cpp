@@ -16,6 +16,11 @@ struct Prepare : Message {
     int sub_compare(Message* rhs) const override {
         return n - dynamic_cast<Prepare*>(rhs)->n;
     }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, n);
+        return true;
+    }
 };
 
 struct PrepareOk : Message {
@@ -31,6 +36,13 @@ struct PrepareOk : Message {
         if (int r = na - dynamic_cast<PrepareOk*>(rhs)->na) return r;
         return va - dynamic_cast<PrepareOk*>(rhs)->va;
     }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, n);
+        flat_put(out, na);
+        flat_put(out, va);
+        return true;
+    }
 };
 
 struct Accept : Message {
@@ -44,6 +56,12 @@ struct Accept : Message {
         if (int r = n - dynamic_cast<Accept*>(rhs)->n) return r;
         return v - dynamic_cast<Accept*>(rhs)->v;
     }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, n);
+        flat_put(out, v);
+        return true;
+    }
 };
 
 struct AcceptOk : Message {
@@ -54,6 +72,11 @@ struct AcceptOk : Message {
     int sub_compare(Message* rhs) const override {
         return n - dynamic_cast<AcceptOk*>(rhs)->n;
     }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, n);
+        return true;
+    }
 };
 
 struct SendProposal : Message {
@@ -64,6 +87,11 @@ struct SendProposal : Message {
     int sub_compare(Message* rhs) const override {
         return v - dynamic_cast<SendProposal*>(rhs)->v;
     }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, v);
+        return true;
+    }
 };
 
 struct StateMachine : Machine {
@@ -77,8 +105,13 @@ struct StateMachine : Machine {
     // by sending a message to itself, requesting a proposal.
     bool should_propose;
 
-    std::set<PrepareOk*> prepares_received;
-    std::set<AcceptOk*> accepts_received;
+    // The acceptors which have answered our ballot (selected_n), one bit per
+    // machine, and the highest (na, va) any of them had accepted. Answers to
+    // other ballots are ignored, since they can never be counted.
+    uint64_t prepares_received = 0;
+    uint64_t accepts_received = 0;
+    int prepared_na = -1;
+    int prepared_va = -1;
 
     // Right now our paxos can only select postive values and
     // I'm okay with that.
@@ -90,59 +123,24 @@ struct StateMachine : Machine {
         : Machine(id, 0), cluster_size(sz), np(np), na(na), va(va),
           should_propose(propose) {}
 
-    StateMachine(id_t id, int sz, int np, int na, int va, bool propose,
-                 std::set<PrepareOk*> prepares_received,
-                 std::set<AcceptOk*> accepts_received,
-                 int selected_n, int selected_v_prime, int final_value)
-        : StateMachine(id, sz, np, na, va, propose) {
-            this->prepares_received = prepares_received;
-            this->accepts_received = accepts_received;
-            this->selected_n = selected_n;
-            this->selected_v_prime = selected_v_prime;
-            this->final_value = final_value;
-        }
-
     StateMachine(id_t id, int sz, bool propose)
         : StateMachine(id, sz, -1, -1, -1, propose) {}
 
     StateMachine* clone() const override {
-        return new StateMachine(id, cluster_size, np, na, va, should_propose,
-                                prepares_received, accepts_received, selected_n,
-                                selected_v_prime, final_value);
-    }
-
-    int count_prepares(int target_n) {
-        int result = 0;
-        for(auto& p : prepares_received) {
-            if(p->n == target_n) {
-                result++;
-            }
-        }
-        return result;
+        StateMachine* m = new StateMachine(id, cluster_size, np, na, va,
+                                           should_propose);
+        m->prepares_received = prepares_received;
+        m->accepts_received = accepts_received;
+        m->prepared_na = prepared_na;
+        m->prepared_va = prepared_va;
+        m->selected_n = selected_n;
+        m->selected_v_prime = selected_v_prime;
+        m->final_value = final_value;
+        return m;
     }
 
-    int count_accepts(int target_n) {
-        int result = 0;
-        for(auto& a : accepts_received) {
-            if(a->n == target_n) {
-                result++;
-            }
-        }
-        return result;
-    }
-
-    int v_from_max_na(int target_n, int my_n, int my_v) {
-        int highest_na = my_n;
-        int ret = my_v;
-        for(auto& p : prepares_received) {
-            if(p->n == target_n) {
-                if(p->na > highest_na) {
-                    highest_na = p->na;
-                    ret = p->va;
-                }
-            }
-        }
-        return ret;
+    int v_from_max_na(int my_n, int my_v) {
+        return prepared_na > my_n ? prepared_va : my_v;
     }
 
 
@@ -151,6 +149,8 @@ struct StateMachine : Machine {
         int n = id*np + 10;
         this->va=m->v;
         selected_n = n;
+        prepares_received = accepts_received = 0;
+        prepared_na = prepared_va = -1;
         for(int i = 0; i < cluster_size; ++i) {
             ret.push_back(new Prepare(this->id, i, n));
         }
@@ -169,11 +169,16 @@ struct StateMachine : Machine {
 
     std::vector<Message*> handle_prepare_ok(PrepareOk *m) {
         std::vector<Message*> ret;
-        prepares_received.insert(m);
-        // printf("num prepareoks inserted %lu\n", prepares_received.size());
-        int pr = count_prepares(selected_n);
+        if(m->n != selected_n) return ret;
+        prepares_received |= 1UL << m->src;
+        if(std::make_pair(m->na, m->va)
+           > std::make_pair(prepared_na, prepared_va)) {
+            prepared_na = m->na;
+            prepared_va = m->va;
+        }
+        int pr = __builtin_popcountl(prepares_received);
         if(pr > (cluster_size / 2)) {
-            int v_prime = v_from_max_na(selected_n, this->selected_n, va);
+            int v_prime = v_from_max_na(this->selected_n, va);
             selected_v_prime = v_prime;
             for(int i = 0; i < cluster_size; ++i) {
                 ret.push_back(new Accept(this->id, i, selected_n, v_prime));
@@ -198,8 +203,9 @@ struct StateMachine : Machine {
     std::vector<Message*> handle_accept_ok(AcceptOk *m) {
         // printf("accepting ok");
         std::vector<Message*> ret;
-        accepts_received.insert(m);
-        int accepts_received2 = count_accepts(selected_n);
+        if(m->n != selected_n) return ret;
+        accepts_received |= 1UL << m->src;
+        int accepts_received2 = __builtin_popcountl(accepts_received);
 
         if(accepts_received2 > (cluster_size / 2)) {
             final_value = selected_v_prime;
@@ -243,38 +249,58 @@ struct StateMachine : Machine {
         if (int r = selected_n - m->selected_n) return r;
         if (int r = selected_v_prime - m->selected_v_prime) return r;
         if (int r = final_value - m->final_value) return r;
-        if (long r = prepares_received.size() - m->prepares_received.size())
-            return r;
-        if (long r = accepts_received.size() - m->accepts_received.size())
-            return r;
-        for (auto it1 = prepares_received.begin(),
-                  it2 = m->prepares_received.begin();
-            it1 != prepares_received.end() && it2 != m->prepares_received.end();
-            ++it1, ++it2) {
-            if (long r = (*it1)->compare((dynamic_cast<Message*>(*it2))))
-                return r;
-        }
-        for (auto it1 = accepts_received.begin(),
-                  it2 = m->accepts_received.begin();
-            it1 != accepts_received.end() && it2 != m->accepts_received.end();
-            ++it1, ++it2) {
-            if (long r = (*it1)->compare((dynamic_cast<Message*>(*it2))))
-                return r;
+        if (prepares_received != m->prepares_received)
+            return prepares_received < m->prepares_received ? -1 : 1;
+        if (accepts_received != m->accepts_received)
+            return accepts_received < m->accepts_received ? -1 : 1;
+        if (int r = prepared_na - m->prepared_na) return r;
+        return prepared_va - m->prepared_va;
+    }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, np);
+        flat_put(out, na);
+        flat_put(out, va);
+        flat_put(out, selected_n);
+        flat_put(out, selected_v_prime);
+        flat_put(out, final_value);
+        flat_put(out, prepares_received);
+        flat_put(out, accepts_received);
+        flat_put(out, prepared_na);
+        flat_put(out, prepared_va);
+        return true;
+    }
+
+    // The answers received are kept by acceptor id
+    void sub_remap(const std::vector<id_t>& to) override {
+        uint64_t prepares = 0, accepts = 0;
+        for (size_t i = 0; i < to.size(); ++i) {
+            prepares |= (prepares_received >> i & 1) << to[i];
+            accepts |= (accepts_received >> i & 1) << to[i];
         }
-        return 0;
+        prepares_received = prepares;
+        accepts_received = accepts;
     }
 };
 
 void print_usage(const char* progname) {
     fprintf(stderr, "usage: %s [OPTIONS]\n"
                     "   -h: print this help message and exit\n"
-                    "   -n: number of machines; defaults to 3\n"
+                    "   -n: number of machines (at most 64); defaults to 3\n"
                     "   -p: index of first proposer; defaults to 0\n"
                     "   -P: index of second proposer; defaults to 0\n"
                     "   -o: don't use symmetry optimization; default is to\n"
                     "   -q: don't print anything; default is to\n"
                     "   -d: maximum depth, or -1 for none; defaults to -1\n"
                     "   -t: time the run; default is not to\n"
+                    "   -s: profile each message handler; default is not to\n"
+                    "   -k: bound the delay of out-of-order deliveries,\n"
+                    "       raising the bound from 0 up to this; default is\n"
+                    "       not to bound it\n"
+                    "   -f: deliver messages between each pair of machines in\n"
+                    "       the order they were sent; default is any order\n"
+                    "   -g: search best-first, preferring states where more\n"
+                    "       acceptors have accepted a value; default is not to\n"
                     "Note that unless overridden, -t implies -q\n",
                     progname);
 }
@@ -287,10 +313,14 @@ int main(int argc, char** argv) {
     bool sym = true;
     bool print = true;
     bool time = false;
+    bool profile = false;
+    int delay = -1;
+    bool fifo = false;
+    bool guided = false;
     int depth = -1;
     int c;
     char* end;
-    while ((c = getopt(argc, argv, "hn:p:P:oqd:t")) != -1) {
+    while ((c = getopt(argc, argv, "hn:p:P:oqd:tsgk:f")) != -1) {
         switch(c) {
             case 'h':
                 print_usage(argv[0]);
@@ -298,7 +328,7 @@ int main(int argc, char** argv) {
             case 'n':
                 end = nullptr;
                 n = strtoul(optarg, &end, 10);
-                if (*end) {
+                if (*end || n > 64) {
                     fprintf(stderr, "%s: invalid number of machines %s\n",
                             argv[0], optarg);
                     print_usage(argv[0]);
@@ -343,6 +373,25 @@ int main(int argc, char** argv) {
             case 'q':
                 print = false;
                 break;
+            case 's':
+                profile = true;
+                break;
+            case 'f':
+                fifo = true;
+                break;
+            case 'k':
+                end = nullptr;
+                delay = strtol(optarg, &end, 10);
+                if (*end || delay < 0) {
+                    fprintf(stderr, "%s: invalid maximum delay %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'g':
+                guided = true;
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
@@ -359,6 +408,14 @@ int main(int argc, char** argv) {
         m.push_back(new StateMachine(i, n, proposer == i || proposer2 == i));
     }
     Model model{m};
+    model.profiling = profile;
+    model.fifo = fifo;
+    // Ballots and values are numbered by the proposer's id, so only the
+    // machines which don't propose are interchangeable
+    model.symmetries.emplace_back();
+    for (size_t i = 0; i < n; ++i) {
+        if (i != proposer && i != proposer2) model.symmetries[0].push_back(i);
+    }
 
     struct timespec re;
     struct timespec start;
@@ -366,8 +423,28 @@ int main(int argc, char** argv) {
         clock_getres(CLOCK_MONOTONIC_RAW, &re);
         clock_gettime(CLOCK_MONOTONIC_RAW, &start);
     }
-    std::set<SystemState> res
-        = model.run(depth, sym, std::vector<Predicate>{}, print);
+    auto accepted = [] (const SystemState& s) {
+        long count = 0;
+        for (Machine* const& m : s.machines) {
+            if (dynamic_cast<StateMachine*>(m)->na >= 0) ++count;
+        }
+        return count;
+    };
+    // Only the values learned are wanted, so tally them rather than keeping
+    // every terminating state
+    std::map<int, size_t> learned;
+    model.keep_terminating = false;
+    model.on_terminal = [&learned] (const SystemState& s) {
+        ++learned[dynamic_cast<StateMachine*>(s.machines[0])->final_value];
+    };
+    Result res;
+    if (guided) {
+        res = model.run_guided(accepted, 0, depth, sym, print);
+    } else if (delay >= 0) {
+        res = model.run_delay_bounded(delay, depth, sym, print);
+    } else {
+        res = model.run(depth, sym, print);
+    }
     if (time) {
         struct timespec end;
         clock_gettime(CLOCK_MONOTONIC_RAW, &end);
@@ -380,11 +457,12 @@ int main(int argc, char** argv) {
         printf("Elapsed time (ns): %ld\n", nsec);
     }
 
+    if (!res.ok()) return 1;
     if (print) {
-        printf("Simluation exited with %lu terminating states.\n", res.size());
-        for(const SystemState& i : res) {
-                StateMachine* sm = dynamic_cast<StateMachine*>(i.machines[0]);
-                printf("Learned value of %d\n", sm->final_value);
+        printf("Simluation exited with %lu terminating states.\n",
+               res.terminated);
+        for (auto& [value, count] : learned) {
+            printf("Learned value of %d in %lu of them\n", value, count);
         }
     }
     return 0;
@@ -1,9 +1,8 @@
 #include <random>
-#include "model.hpp"
+#include "typed.hpp"
 
 // An implementation of n-way replication, inspired by the P# paper
 
-#define MSG_TIME  1
 #define MSG_CLNT  2
 #define MSG_REPL  3
 #define MSG_SYNC  4
@@ -13,20 +12,38 @@
 #define MCH_SRV   2
 #define MCH_NODE  3
 
+#define TMR_SYNC  0
+
+// How many times a node sends the sync for each length of its log: the resend
+// is what a real node would do over a lossy network, so the server mustn't
+// count one node's syncs twice
+#define SYNC_TRIES 2
+
 typedef unsigned long data_t;
 
-// A message with a simple data payload, used for both CLNT and REPL messages
+// A message with a simple data payload, used for both CLNT and REPL messages.
+// It carries the item's index in the client's data, so a node can tell a
+// resent item it already has from the next one.
 struct Payload : Message {
+    int index;
     data_t data;
-    Payload(id_t src, id_t dst, int type, data_t data)
-        : Message(src, dst, type), data(data) {}
+    Payload(id_t src, id_t dst, int type, int index, data_t data)
+        : Message(src, dst, type), index(index), data(data) {}
 
     int sub_compare(Message* rhs) const override {
-        return data - dynamic_cast<Payload*>(rhs)->data;
+        Payload* p = dynamic_cast<Payload*>(rhs);
+        if (int r = index - p->index) return r;
+        return data - p->data;
+    }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, index);
+        flat_put(out, data);
+        return true;
     }
 
     void sub_print() const override {
-        printf("    Data: %lu\n", data);
+        printf("    Index: %d\n    Data: %lu\n", index, data);
     }
 };
 
@@ -39,19 +56,221 @@ struct Sync : Message {
         return index - dynamic_cast<Sync*>(rhs)->index;
     }
 
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, index);
+        return true;
+    }
+
     void sub_print() const override {
         printf("    Index: %d\n", index);
     }
 };
 
-struct Client : Machine {
+// The same messages as value types, for the compile-time specialized engine
+namespace typed {
+
+struct Payload : TypedMessage {
+    int type;
+    int index;
+    data_t data;
+
+    Payload(id_t src, id_t dst, int type, int index, data_t data)
+        : TypedMessage(src, dst), type(type), index(index), data(data) {}
+
+    auto operator<=>(const Payload&) const = default;
+
+    void print() const {
+        printf("    Index: %d\n    Data: %lu\n", index, data);
+    }
+};
+
+struct Sync : TypedMessage {
+    static constexpr int type = MSG_SYNC;
+    int index;
+
+    Sync(id_t src, id_t dst, int index) : TypedMessage(src, dst), index(index) {}
+
+    auto operator<=>(const Sync&) const = default;
+
+    void print() const {
+        printf("    Index: %d\n", index);
+    }
+};
+
+struct Ack : TypedMessage {
+    static constexpr int type = MSG_ACK;
+
+    Ack(id_t src, id_t dst) : TypedMessage(src, dst) {}
+
+    auto operator<=>(const Ack&) const = default;
+};
+
+typedef std::variant<Payload, Sync, Ack> AnyMessage;
+typedef std::vector<AnyMessage> Outbox;
+
+}
+
+// Sending each kind of message, on either engine: the protocol below is
+// written once against these, and sends to whichever outbox it's given
+static void send_payload(std::vector<Message*>& out, id_t src, id_t dst,
+                         int type, int index, data_t data) {
+    out.push_back(new Payload(src, dst, type, index, data));
+}
+static void send_payload(typed::Outbox& out, id_t src, id_t dst, int type,
+                         int index, data_t data) {
+    out.push_back(typed::Payload{src, dst, type, index, data});
+}
+static void send_sync(std::vector<Message*>& out, id_t src, id_t dst,
+                      int index) {
+    out.push_back(new Sync(src, dst, index));
+}
+static void send_sync(typed::Outbox& out, id_t src, id_t dst, int index) {
+    out.push_back(typed::Sync{src, dst, index});
+}
+static void send_ack(std::vector<Message*>& out, id_t src, id_t dst) {
+    out.push_back(new Message(src, dst, MSG_ACK));
+}
+static void send_ack(typed::Outbox& out, id_t src, id_t dst) {
+    out.push_back(typed::Ack{src, dst});
+}
+
+// The protocol's machines, over either engine's machine base (Machine or
+// TypedMachine, constructed from the trailing arguments). Each engine's
+// machines below only add how messages reach these handlers.
+template <typename Base>
+struct ClientRole : Base {
     id_t server;
     std::vector<data_t> data;
     // The next data to send (one past the last acknowledged)
     unsigned index;
 
+    template <typename... Args>
+    ClientRole(id_t server, std::vector<data_t> data, Args... base)
+        : Base(base...), server(server), data(data), index(0) {}
+
+    auto operator<=>(const ClientRole&) const = default;
+
+    template <typename Out>
+    void start(Out& out) const {
+        send_payload(out, this->id, server, MSG_CLNT, 0, data[0]);
+    }
+
+    template <typename Out>
+    void on_ack(Out& out) {
+        if (++index < data.size()) {
+            send_payload(out, this->id, server, MSG_CLNT, index, data[index]);
+        }
+    }
+
+    // Whether `log` has every item acknowledged so far
+    bool replicated(const SharedLog<data_t>& log) const {
+        if (!index) return true;
+        unsigned ind = index - 1;
+        return log.size() > ind && log[ind] == data[ind];
+    }
+};
+
+template <typename Base>
+struct ServerRole : Base {
+    id_t client;
+    id_t first_node;
+    size_t nodes;
+    int index;
+    data_t data;
+    #ifdef B
+    unsigned repcount;
+    #else
+    std::vector<bool> reps;
+    #endif
+
+    template <typename... Args>
+    ServerRole(id_t client, id_t first_node, size_t nodes, Args... base)
+        : Base(base...), client(client), first_node(first_node),
+          nodes(nodes), index(-1), data(0) {
+        #ifdef B
+        repcount = 0;
+        #else
+        reps.assign(nodes, false);
+        #endif
+    }
+
+    auto operator<=>(const ServerRole&) const = default;
+
+    template <typename Out>
+    void on_clnt(data_t d, Out& out) {
+        #ifdef B
+        repcount = 0;
+        #else
+        reps.assign(nodes, false);
+        #endif
+        ++index;
+        data = d;
+        for (size_t i = 0; i < nodes; ++i) {
+            send_payload(out, this->id, first_node + i, MSG_REPL, index, data);
+        }
+    }
+
+    // Syncs carry the log's length, so the current item is only there once
+    // it's past our (0-based) index
+    template <typename Out>
+    void on_sync(id_t src, int ind, Out& out) {
+        if (ind <= index) {
+            send_payload(out, this->id, src, MSG_REPL, index, data);
+            return;
+        }
+        #ifdef B
+        if (++repcount == nodes) send_ack(out, this->id, client);
+        #else
+        // Only the sync completing the set acknowledges, so the client hears
+        // about each item exactly once
+        if (reps[src - first_node]) return;
+        reps[src - first_node] = true;
+        for (size_t i = 0; i < nodes; ++i) {
+            if (!reps[i]) return;
+        }
+        send_ack(out, this->id, client);
+        #endif
+    }
+};
+
+template <typename Base>
+struct NodeRole : Base {
+    id_t server;
+    SharedLog<data_t> log;
+    // Syncs sent since the log last grew
+    unsigned syncs;
+
+    template <typename... Args>
+    NodeRole(id_t server, Args... base)
+        : Base(base...), server(server), syncs(0) {}
+
+    auto operator<=>(const NodeRole&) const = default;
+
+    // Resent items may arrive more than once
+    template <typename Out>
+    void on_repl(int ind, data_t d, Out& out) {
+        if (ind == (int) log.size()) {
+            log.push_back(d);
+            syncs = 0;
+        }
+        this->arm(TMR_SYNC);
+    }
+
+    // Periodically sync with the server, until the log's length has been
+    // sent SYNC_TRIES times; later firings change nothing, so they're skipped
+    template <typename Out>
+    void on_sync_timer(Out& out) {
+        this->arm(TMR_SYNC);
+        if (syncs < SYNC_TRIES) {
+            ++syncs;
+            send_sync(out, this->id, server, log.size());
+        }
+    }
+};
+
+struct Client : ClientRole<Machine> {
     Client(id_t id, id_t server, std::vector<data_t> data)
-        : Machine(id, MCH_CLNT), server(server), data(data), index(0) {}
+        : ClientRole(server, data, id, MCH_CLNT) {}
 
     Client* clone() const override {
         Client* c = new Client(id, server, data);
@@ -63,18 +282,21 @@ struct Client : Machine {
         return index - dynamic_cast<Client*>(rhs)->index;
     }
 
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, index);
+        return true;
+    }
+
     std::vector<Message*> on_startup() override {
         std::vector<Message*> ret;
-        ret.push_back(new Payload(id, server, MSG_CLNT, data[0]));
+        start(ret);
         return ret;
     }
 
     std::vector<Message*> handle_message(Message* m) override {
         std::vector<Message*> ret;
         if (m->type == MSG_ACK) {
-            if (++index < data.size()) {
-                ret.push_back(new Payload(id, server, MSG_CLNT, data[index]));
-            }
+            on_ack(ret);
         } else {
             error = ERR_BADMSG;
         }
@@ -82,27 +304,9 @@ struct Client : Machine {
     }
 };
 
-struct Server : Machine {
-    id_t client;
-    id_t first_node;
-    size_t nodes;
-    int index;
-    data_t data;
-    #ifdef B
-    unsigned repcount;
-    #else
-    std::vector<bool> reps;
-    #endif
-
+struct Server : ServerRole<Machine> {
     Server(id_t id, id_t client, id_t first_node, size_t nodes)
-        : Machine(id, MCH_SRV), client(client), first_node(first_node),
-          nodes(nodes), index(-1) {
-        #ifdef B
-        repcount = 0;
-        #else
-        reps.assign(nodes, false);
-        #endif
-    }
+        : ServerRole(client, first_node, nodes, id, MCH_SRV) {}
 
     Server* clone() const override {
         Server* s = new Server(id, client, first_node, nodes);
@@ -131,43 +335,35 @@ struct Server : Machine {
         return 0;
     }
 
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, index);
+        flat_put(out, data);
+        #ifdef B
+        flat_put(out, repcount);
+        #else
+        for (bool r : reps) flat_put(out, r);
+        #endif
+        return true;
+    }
+
+    #ifndef B
+    void sub_remap(const std::vector<id_t>& to) override {
+        std::vector<bool> old = reps;
+        for (size_t i = 0; i < nodes; ++i) {
+            reps[to[first_node + i] - first_node] = old[i];
+        }
+    }
+    #endif
+
     std::vector<Message*> handle_message(Message* m) override {
         std::vector<Message*> ret;
         switch (m->type) {
             case MSG_CLNT:
-                #ifdef B
-                repcount = 0;
-                #else
-                reps.assign(nodes, false);
-                #endif
-                ++index;
-                data = dynamic_cast<Payload*>(m)->data;
-                for (size_t i = 0; i < nodes; ++i) {
-                    ret.push_back(new Payload(id, first_node + i, MSG_REPL, data));
-                }
+                on_clnt(dynamic_cast<Payload*>(m)->data, ret);
                 break;
-            case MSG_SYNC: {
-                int ind = dynamic_cast<Sync*>(m)->index;
-                if (ind < index) {
-                    ret.push_back(new Payload(id, m->src, MSG_REPL, data));
-                } else {
-                    #ifdef B
-                    if (++repcount == nodes) {
-                        ret.push_back(new Message(id, client, MSG_ACK));
-                    }
-                    #else
-                    reps[m->src] = true;
-                    size_t i;
-                    for (i = 0; i < nodes; ++i) {
-                        if (!reps[i]) break;
-                    }
-                    if (i == nodes) {
-                        ret.push_back(new Message(id, client, MSG_ACK));
-                    }
-                    #endif
-                }
+            case MSG_SYNC:
+                on_sync(m->src, dynamic_cast<Sync*>(m)->index, ret);
                 break;
-            }
             default:
                 error = ERR_BADMSG;
                 break;
@@ -176,50 +372,94 @@ struct Server : Machine {
     }
 };
 
-struct Node : Machine {
-    id_t server;
-    bool timer;
-    std::vector<data_t> log;
-
-    Node(id_t id, id_t server)
-        : Machine(id, MCH_NODE), server(server), timer(false) {}
+struct Node : NodeRole<Machine> {
+    Node(id_t id, id_t server) : NodeRole(server, id, MCH_NODE) {}
 
     Node* clone() const override {
         Node* n = new Node(id, server);
-        n->timer = timer;
         n->log = log;
+        n->syncs = syncs;
         return n;
     }
 
     int sub_compare(Machine* rhs) const override {
         Node* n = dynamic_cast<Node*>(rhs);
-        if (int r = (int) timer - n->timer) return r;
-        if (long r = (long) log.size() - n->log.size()) return r;
-        return memcmp(log.data(), n->log.data(), log.size() * sizeof(data_t));
+        if (int r = (int) syncs - n->syncs) return r;
+        return log.compare(n->log);
+    }
+
+    bool sub_flatten(std::string& out) const override {
+        flat_put(out, syncs);
+        log.flatten(out);
+        return true;
     }
 
     std::vector<Message*> handle_message(Message* m) override {
         std::vector<Message*> ret;
-        switch (m->type) {
-            case MSG_REPL:
-                log.push_back(dynamic_cast<Payload*>(m)->data);
-                if (!timer) {
-                    timer = true;
-                    ret.push_back(new Message(id, id, MSG_TIME));
-                }
-                break;
-            case MSG_TIME:
-                ret.push_back(new Message(id, id, MSG_TIME));
-                ret.push_back(new Sync(id, server, log.size()));
-                break;
-            default:
-                error = ERR_BADMSG;
-                break;
+        if (m->type == MSG_REPL) {
+            Payload* p = dynamic_cast<Payload*>(m);
+            on_repl(p->index, p->data, ret);
+        } else {
+            error = ERR_BADMSG;
         }
         return ret;
     }
+
+    std::vector<Message*> on_timer(int t) override {
+        std::vector<Message*> ret;
+        on_sync_timer(ret);
+        return ret;
+    }
 };
 
+// The same machines for the compile-time specialized engine
+namespace typed {
+
+struct Client : ClientRole<TypedMachine> {
+    Client(id_t id, id_t server, std::vector<data_t> data)
+        : ClientRole(server, data, id) {}
+
+    void on_startup(Outbox& out) {
+        start(out);
+    }
+
+    void handle(const Ack& m, Outbox& out) {
+        on_ack(out);
+    }
+};
+
+struct Server : ServerRole<TypedMachine> {
+    Server(id_t id, id_t client, id_t first_node, size_t nodes)
+        : ServerRole(client, first_node, nodes, id) {}
+
+    void handle(const Payload& m, Outbox& out) {
+        if (m.type == MSG_CLNT) on_clnt(m.data, out);
+        else error = ERR_BADMSG;
+    }
+
+    void handle(const Sync& m, Outbox& out) {
+        on_sync(m.src, m.index, out);
+    }
+};
+
+struct Node : NodeRole<TypedMachine> {
+    Node(id_t id, id_t server) : NodeRole(server, id) {}
+
+    void handle(const Payload& m, Outbox& out) {
+        if (m.type == MSG_REPL) on_repl(m.index, m.data, out);
+        else error = ERR_BADMSG;
+    }
+
+    void on_timer(int t, Outbox& out) {
+        on_sync_timer(out);
+    }
+};
+
+typedef std::variant<Client, Server, Node> AnyMachine;
+typedef TypedModel<AnyMachine, AnyMessage> Model;
+
+}
+
 void print_usage(const char* progname) {
     fprintf(stderr, "usage: %s [OPTIONS]\n"
                     "   -h: print this help message and exit\n"
@@ -229,6 +469,36 @@ void print_usage(const char* progname) {
                     "   -q: don't print anything; default is to\n"
                     "   -d: maximum depth, or -1 for none; defaults to -1\n"
                     "   -t: time the run; default is not to\n"
+                    "   -s: profile each message handler; default is not to\n"
+                    "   -k: bound the delay of out-of-order deliveries,\n"
+                    "       raising the bound from 0 up to this; default is\n"
+                    "       not to bound it\n"
+                    "   -f: deliver messages between each pair of machines in\n"
+                    "       the order they were sent; default is any order\n"
+                    "   -i: use iterative deepening depth-first search;\n"
+                    "       default is breadth-first\n"
+                    "   -c: visited states to cache with -i; defaults to 0\n"
+                    "   -w: simulate this many random walks instead, each as\n"
+                    "       long as the maximum depth (or 1000 steps)\n"
+                    "   -e: seed of the first random walk; defaults to the time\n"
+                    "   -l: check instead that the client is eventually\n"
+                    "       acknowledged, assuming fair delivery\n"
+                    "   -m: keep visited states flattened into one buffer\n"
+                    "       each (with -w, count the distinct states\n"
+                    "       walked through); default is not to\n"
+                    "   -v: use the compile-time specialized engine, which\n"
+                    "       only searches breadth-first (without symmetry)\n"
+                    "   -p: search breadth-first (without symmetry) split over\n"
+                    "       this many processes, or 0 for one per core\n"
+                    "   -x: stop after this many invariant violations, or 0\n"
+                    "       to find them all; defaults to 1\n"
+                    "   -T: write the first violation found to this file as\n"
+                    "       a binary trace\n"
+                    "   -R: replay the binary trace in this file (written\n"
+                    "       with the same options) instead of searching\n"
+                    "   -M: shrink the history of the first violation found\n"
+                    "       to a minimal one and print it (and write it with\n"
+                    "       -T)\n"
                     "Note that -t implies -q\n",
                     progname);
 }
@@ -240,10 +510,25 @@ int main(int argc, char** argv) {
     bool sym = true;
     bool print = true;
     bool time = false;
+    bool profile = false;
+    int delay = -1;
+    bool fifo = false;
+    bool dfs = false;
+    size_t cache = 0;
+    size_t walks = 0;
+    unsigned long seed = ::time(0);
+    bool live = false;
+    bool fast = false;
+    bool flat = false;
+    long procs = -1;
+    size_t violations = 1;
+    const char* save = nullptr;
+    const char* load = nullptr;
+    bool minimize = false;
     int depth = -1;
     int c;
     char* end;
-    while ((c = getopt(argc, argv, "hn:r:oqd:t")) != -1) {
+    while ((c = getopt(argc, argv, "hn:r:oqd:tsic:w:e:lk:fvmp:x:T:R:M")) != -1) {
         switch(c) {
             case 'h':
                 print_usage(argv[0]);
@@ -286,6 +571,92 @@ int main(int argc, char** argv) {
             case 'q':
                 print = false;
                 break;
+            case 's':
+                profile = true;
+                break;
+            case 'f':
+                fifo = true;
+                break;
+            case 'k':
+                end = nullptr;
+                delay = strtol(optarg, &end, 10);
+                if (*end || delay < 0) {
+                    fprintf(stderr, "%s: invalid maximum delay %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'i':
+                dfs = true;
+                break;
+            case 'l':
+                live = true;
+                break;
+            case 'v':
+                fast = true;
+                break;
+            case 'm':
+                flat = true;
+                break;
+            case 'c':
+                end = nullptr;
+                cache = strtoul(optarg, &end, 10);
+                if (*end) {
+                    fprintf(stderr, "%s: invalid cache size %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'x':
+                end = nullptr;
+                violations = strtoul(optarg, &end, 10);
+                if (*end) {
+                    fprintf(stderr, "%s: invalid number of violations %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'T':
+                save = optarg;
+                break;
+            case 'R':
+                load = optarg;
+                break;
+            case 'M':
+                minimize = true;
+                break;
+            case 'w':
+                end = nullptr;
+                walks = strtoul(optarg, &end, 10);
+                if (*end) {
+                    fprintf(stderr, "%s: invalid number of walks %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'p':
+                end = nullptr;
+                procs = strtol(optarg, &end, 10);
+                if (*end || procs < 0) {
+                    fprintf(stderr, "%s: invalid number of processes %s\n",
+                            argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'e':
+                end = nullptr;
+                seed = strtoul(optarg, &end, 10);
+                if (*end) {
+                    fprintf(stderr, "%s: invalid seed %s\n", argv[0], optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
@@ -296,6 +667,20 @@ int main(int argc, char** argv) {
         print_usage(argv[0]);
         return 1;
     }
+    // The typed engine only searches breadth-first, with none of the general
+    // engine's options
+    std::pair<bool, char> unsupported[] = {
+        {fifo, 'f'}, {delay >= 0, 'k'}, {profile, 's'}, {dfs, 'i'},
+        {walks > 0, 'w'}, {live, 'l'}, {procs >= 0, 'p'}, {flat, 'm'},
+        {save, 'T'}, {load, 'R'}, {minimize, 'M'},
+    };
+    for (auto [set, flag] : unsupported) {
+        if (fast && set) {
+            fprintf(stderr, "%s: -v can't be used with -%c\n", argv[0], flag);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
 
     std::vector<data_t> data;
     std::mt19937_64 r;
@@ -309,19 +694,26 @@ int main(int argc, char** argv) {
         m.push_back(new Node(i, 1));
     }
     std::vector<Predicate> i;
-    auto pred = [nodes, rounds] (const SystemState& s) {
-        Client* c = dynamic_cast<Client*>(s.machines[0]);
-        if (!c->index) return true;
-        unsigned ind = c->index - 1;
+    // Logs only grow, so only the client being acknowledged can break this
+    auto pred = [nodes] (const std::vector<Machine*>& ms, id_t j) {
+        if (j) return true;
+        Client* c = dynamic_cast<Client*>(ms[0]);
         for (size_t i = 2; i < 2 + nodes; ++i) {
-            Node* n = dynamic_cast<Node*>(s.machines[i]);
-            if (n->log.size() <= ind) return false;
-            if (n->log[ind] != c->data[ind]) return false;
+            if (!c->replicated(dynamic_cast<Node*>(ms[i])->log)) return false;
         }
         return true;
     };
     i.push_back(Predicate{"Ack not received before replicated", pred});
     Model model{m, i};
+    model.profiling = profile;
+    model.fifo = fifo;
+    model.visited.flat = flat;
+    model.max_violations = violations;
+    // Only the number of terminating states is printed
+    model.keep_terminating = false;
+    // The nodes are interchangeable; the client and server aren't
+    model.symmetries.emplace_back();
+    for (size_t i = 2; i < 2 + nodes; ++i) model.symmetries[0].push_back(i);
 
     struct timespec re;
     struct timespec start;
@@ -329,8 +721,69 @@ int main(int argc, char** argv) {
         clock_getres(CLOCK_MONOTONIC_RAW, &re);
         clock_gettime(CLOCK_MONOTONIC_RAW, &start);
     }
-    std::set<SystemState> res
-        = model.run(depth, sym, std::vector<Predicate>{}, print);
+    // Terminating states found (or states explored, for -l), and whether any
+    // invariant was violated
+    size_t res;
+    bool failed;
+    Predicate acked{"Client acknowledged", [rounds] (const SystemState& s) {
+        return dynamic_cast<Client*>(s.machines[0])->index == rounds;
+    }};
+    if (fast) {
+        std::vector<typed::AnyMachine> tm;
+        tm.push_back(typed::Client{0, 1, data});
+        tm.push_back(typed::Server{1, 0, 2, nodes});
+        for (size_t i = 2; i < 2 + nodes; ++i) {
+            tm.push_back(typed::Node{(id_t) i, 1});
+        }
+        auto tpred = [nodes] (const typed::Model::State& s) {
+            const typed::Client& c = std::get<typed::Client>(s.machines[0]);
+            for (size_t i = 2; i < 2 + nodes; ++i) {
+                if (!c.replicated(std::get<typed::Node>(s.machines[i]).log)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        typed::Model tmodel{tm, {{"Ack not received before replicated",
+                                  tpred}}};
+        tmodel.max_violations = violations;
+        typed::Model::Result r = tmodel.run(depth, print);
+        res = r.terminated;
+        failed = !r.ok();
+    } else {
+        Result r;
+        std::vector<uint32_t> steps;
+        if (load) {
+            if (!model.load_trace(load, steps)) return 1;
+            r = model.replay(steps, print);
+            // A trace which can't be replayed fails too
+            if (r.stopped && r.ok()) return 1;
+        } else if (live) {
+            r = model.run_liveness(acked, depth, print);
+        } else if (walks) {
+            r = model.simulate(walks, depth < 0 ? 1000 : depth, seed, 0,
+                               print);
+        } else if (dfs) {
+            r = model.run_dfs(depth, cache, print);
+        } else if (procs >= 0) {
+            r = model.run_distributed(procs, depth, print);
+        } else if (delay >= 0) {
+            r = model.run_delay_bounded(delay, depth, sym, print);
+        } else {
+            r = model.run(depth, sym, print);
+        }
+        res = live ? r.explored : r.terminated;
+        failed = !r.ok();
+        if (failed && minimize) {
+            r.violations[0].state = model.minimize(r.violations[0]);
+            printf("Minimized history:\n");
+            r.violations[0].state.print_history();
+        }
+        if (save && failed
+            && !model.save_trace(r.violations[0].state, save)) {
+            return 1;
+        }
+    }
     if (time) {
         struct timespec end;
         clock_gettime(CLOCK_MONOTONIC_RAW, &end);
@@ -343,7 +796,8 @@ int main(int argc, char** argv) {
         printf("Elapsed time (ns): %ld\n", nsec);
     }
 
-    if (print)
-        printf("Simluation exited with %lu terminating states.\n", res.size());
+    if (failed) return 1;
+    if (print && !live)
+        printf("Simluation exited with %lu terminating states.\n", res);
     return 0;
 }
@@ -0,0 +1,291 @@
+#include <optional>
+#include <variant>
+#include "model.hpp"
+
+// A compile-time specialized alternative to Model. Machines and messages are
+// plain value types, held inline in the state by std::variant, so copying or
+// comparing a state doesn't chase pointers and handlers are dispatched with
+// std::visit instead of virtual calls and dynamic_casts. Only breadth-first
+// search is supported; the models for the general engine keep working on it.
+//
+// Machines derive from TypedMachine, and messages from TypedMessage. Both must
+// be three-way comparable (a defaulted operator<=> will do). A machine handles
+// message type M with `void handle(const M&, std::vector<Message>& out)`, where
+// Message is the message variant; a delivery with no matching handler sets
+// ERR_BADMSG. It may also define `void on_startup(std::vector<Message>&)` and
+// `void on_timer(int, std::vector<Message>&)`. Messages must have a `type`
+// (usually a static constexpr int), may set `static constexpr bool may_drop`,
+// and may define `void print() const` (indenting 4 spaces, like sub_print).
+
+struct TypedMachine {
+    id_t id;
+    int error = 0;
+    // The set of armed timers, as for Machine
+    unsigned timers = 0;
+
+    TypedMachine(id_t id) : id(id) {}
+
+    void arm(int t) {
+        timers |= 1u << t;
+    }
+    void cancel(int t) {
+        timers &= ~(1u << t);
+    }
+    bool armed(int t) const {
+        return timers >> t & 1;
+    }
+
+    auto operator<=>(const TypedMachine&) const = default;
+};
+
+struct TypedMessage {
+    id_t src;
+    id_t dst;
+
+    TypedMessage(id_t src, id_t dst) : src(src), dst(dst) {}
+
+    auto operator<=>(const TypedMessage&) const = default;
+};
+
+template <typename Machine, typename Message>
+struct TypedModel final {
+    struct State {
+        std::vector<Machine> machines;
+        std::vector<Message> messages;
+
+        auto operator<=>(const State&) const = default;
+
+        bool terminated() const {
+            if (!messages.empty()) return false;
+            for (const Machine& m : machines) {
+                if (base(m).timers) return false;
+            }
+            return true;
+        }
+    };
+
+    struct Predicate {
+        const char* name;
+        std::function<bool(const State&)> match;
+    };
+
+    // Every state visited, and how it was reached: from which state (an index
+    // into `nodes`) by delivering or dropping which message, or by firing
+    // which timer of which machine
+    struct Node {
+        const State* state;
+        size_t parent;
+        bool drop;
+        long fired;
+        int timer;
+        std::optional<Message> msg;
+    };
+    std::map<State, size_t> visited;
+    std::vector<Node> nodes;
+    std::vector<Predicate> invariants;
+    // Stop after this many violations (0 for no limit), as Model does
+    size_t max_violations = 1;
+
+    // The outcome of a run, as for Model::run, but naming each violating
+    // state by its node
+    struct Violation {
+        const Predicate* invariant;
+        size_t node;
+    };
+    struct Result {
+        std::vector<Violation> violations;
+        bool stopped = false;
+        size_t terminated = 0;
+        size_t explored = 0;
+        int depth = 0;
+
+        bool ok() const {
+            return violations.empty();
+        }
+    };
+
+    // Initialize with the machines (which are started up) and invariants
+    TypedModel(std::vector<Machine> m,
+               std::vector<Predicate> i = std::vector<Predicate>{})
+        : invariants(i) {
+        invariants.push_back(Predicate{"Valid messages", [] (const State& s) {
+            for (const Machine& m : s.machines) {
+                if (base(m).error == ERR_BADMSG) return false;
+            }
+            return true;
+        }});
+        State s{m, std::vector<Message>{}};
+        for (Machine& mach : s.machines) {
+            std::visit([&] (auto& x) {
+                if constexpr (requires { x.on_startup(s.messages); }) {
+                    x.on_startup(s.messages);
+                }
+            }, mach);
+        }
+        add(s, Node{nullptr, 0, false, -1, 0, std::nullopt});
+    }
+
+    static const TypedMachine& base(const Machine& m) {
+        return std::visit([] (const TypedMachine& x) -> const TypedMachine& {
+            return x;
+        }, m);
+    }
+
+    static TypedMachine& base(Machine& m) {
+        return std::visit([] (TypedMachine& x) -> TypedMachine& {
+            return x;
+        }, m);
+    }
+
+    static const TypedMessage& header(const Message& m) {
+        return std::visit([] (const TypedMessage& x) -> const TypedMessage& {
+            return x;
+        }, m);
+    }
+
+    static int type(const Message& m) {
+        return std::visit([] (const auto& x) { return x.type; }, m);
+    }
+
+    static bool may_drop(const Message& m) {
+        return std::visit([] (const auto& x) {
+            if constexpr (requires { x.may_drop; }) return x.may_drop;
+            else return false;
+        }, m);
+    }
+
+    // Record `s`, reached as `how`, unless it has been visited; returns its
+    // node index, or -1 if it was already there
+    long add(const State& s, Node how) {
+        auto [it, added] = visited.emplace(s, nodes.size());
+        if (!added) return -1;
+        how.state = &it->first;
+        nodes.push_back(how);
+        return nodes.size() - 1;
+    }
+
+    // Print how node `n` was reached, like SystemState::print_history
+    void print_history(size_t n) const {
+        std::vector<size_t> path;
+        for (; n; n = nodes[n].parent) path.push_back(n);
+        fprintf(stderr, "History stack trace:\n");
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            const Node& node = nodes[*it];
+            if (node.fired >= 0) {
+                printf("Timer %d of machine %ld fired\n", node.timer,
+                       node.fired);
+                continue;
+            }
+            const TypedMessage& h = header(*node.msg);
+            if (node.drop) {
+                printf("Message from %u (type %d) dropped\n", h.src,
+                       type(*node.msg));
+            } else {
+                printf("Message from %u (type %d) delivered to %u\n", h.src,
+                       type(*node.msg), h.dst);
+            }
+            std::visit([] (const auto& x) {
+                if constexpr (requires { x.print(); }) x.print();
+            }, *node.msg);
+        }
+    }
+
+    // Model check breadth-first until a maximum depth (-1 for indefinitely),
+    // reporting invariant violations (and not expanding those states) as
+    // Model::run does. States are deduped as soon as they're generated.
+    Result run(int max_depth = -1, bool print = true) {
+        Result res;
+        std::vector<size_t> layer{0};
+        size_t& terminating = res.terminated;
+        size_t nodes_seen = 0;
+        int depth = 0;
+
+        while ((max_depth < 0 || depth <= max_depth) && !layer.empty()
+               && !res.stopped) {
+            if (print) {
+                printf("Depth searched: %d\n    Total nodes explored: %lu\n"
+                       "    Unique nodes visited: %lu\n"
+                       "    Frontier size: %lu\n"
+                       "    Terminating states found: %lu\n",
+                       depth, nodes_seen, visited.size(), layer.size(),
+                       terminating);
+            }
+            std::vector<size_t> next;
+            for (size_t n : layer) {
+                ++nodes_seen;
+                // Careful: `nodes` grows as we go
+                const State& s = *nodes[n].state;
+                const Predicate* bad = nullptr;
+                for (const Predicate& p : invariants) {
+                    if (!p.match(s)) {
+                        bad = &p;
+                        break;
+                    }
+                }
+                if (bad) {
+                    printf("INVARIANT VIOLATED: %s\n", bad->name);
+                    print_history(n);
+                    res.violations.push_back(Violation{bad, n});
+                    if (max_violations
+                        && res.violations.size() >= max_violations) {
+                        res.stopped = true;
+                        break;
+                    }
+                    continue;
+                }
+                if (s.terminated()) ++terminating;
+                expand(n, next);
+            }
+            layer = std::move(next);
+            ++depth;
+        }
+        printf("Terminating depth: %d\n", depth - 1);
+        printf("Total nodes explored: %lu\n", nodes_seen);
+        res.explored = nodes_seen;
+        res.depth = depth - 1;
+        return res;
+    }
+
+    // Queue the unvisited successors of node `n` onto `next`
+    void expand(size_t n, std::vector<size_t>& next) {
+        const State& s = *nodes[n].state;
+        for (size_t i = 0; i < s.messages.size(); ++i) {
+            const Message& msg = s.messages[i];
+            State del = s;
+            del.messages.erase(del.messages.begin() + i);
+            Machine& target = del.machines[header(msg).dst];
+            std::visit([&] (auto& m, const auto& x) {
+                if constexpr (requires { m.handle(x, del.messages); }) {
+                    m.handle(x, del.messages);
+                } else {
+                    m.error = ERR_BADMSG;
+                }
+            }, target, msg);
+            long k = add(del, Node{nullptr, n, false, -1, 0, msg});
+            if (k >= 0) next.push_back(k);
+
+            if (may_drop(msg)) {
+                State drop = s;
+                drop.messages.erase(drop.messages.begin() + i);
+                k = add(drop, Node{nullptr, n, true, -1, 0, msg});
+                if (k >= 0) next.push_back(k);
+            }
+        }
+        for (size_t j = 0; j < s.machines.size(); ++j) {
+            for (unsigned t = base(s.machines[j]).timers; t; t &= t - 1) {
+                int timer = __builtin_ctz(t);
+                State fire = s;
+                std::visit([&] (auto& m) {
+                    m.cancel(timer);
+                    if constexpr (requires { m.on_timer(timer,
+                                                        fire.messages); }) {
+                        m.on_timer(timer, fire.messages);
+                    }
+                }, fire.machines[j]);
+                long k = add(fire, Node{nullptr, n, false, (long) j, timer,
+                                        std::nullopt});
+                if (k >= 0) next.push_back(k);
+            }
+        }
+    }
+};